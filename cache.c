@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+#include "he3cc.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+// 関数単位のコードキャッシュ (--cache-dir)
+//
+// 関数ごとに生成したARM64のアセンブリを、内容から求めたハッシュ値を
+// 名前にしたファイルに保存しておく。次のコンパイルで同じ関数が現れたら、
+// その関数の最適化とコード生成を省いて保存したコードをそのまま使う。
+// ハッシュ値は次のものから求める:
+//   - 関数定義のソース (先頭のトークンから閉じ括弧まで)
+//   - 関数が参照するグローバル変数の名前と型
+//   - コード生成に影響するオプション
+// 関数内のラベルや文字列リテラルの名前には関数名が入っているので、
+// 生成したコードは他の関数に依存しない。
+
+// キャッシュを置くディレクトリ (NULLならキャッシュを使わない)
+char *cache_dir;
+
+// キャッシュの形式が変わったら変える
+#define CACHE_VERSION "he3cc-fn-1"
+
+// FNV-1aでハッシュ値hにlenバイトを加える
+unsigned long hash_bytes(unsigned long h, void *p, int len) {
+  for (unsigned char *c = p; len > 0; c++, len--) {
+    h ^= *c;
+    h *= 0x100000001b3;
+  }
+  return h;
+}
+
+unsigned long hash_int(unsigned long h, long val) {
+  return hash_bytes(h, &val, sizeof(val));
+}
+
+unsigned long hash_string(unsigned long h, char *s) {
+  return hash_bytes(h, s, strlen(s) + 1);
+}
+
+// 式と文が参照するグローバル変数の名前と型をハッシュ値に加える
+unsigned long hash_globals(unsigned long h, Node *node) {
+  if (!node)
+    return h;
+
+  if (node->kind == ND_VAR && !node->var->is_local) {
+    h = hash_string(h, node->var->name);
+    for (Type *ty = node->var->ty; ty; ty = ty->base) {
+      h = hash_int(h, ty->kind);
+      h = hash_int(h, ty->array_size);
+    }
+  }
+
+  Node **slots[MAX_CHILDREN];
+  int nslots = child_slots(node, slots);
+  for (int i = 0; i < nslots; i++)
+    for (Node *n = *slots[i]; n; n = n->next)
+      h = hash_globals(h, n);
+  return h;
+}
+
+// 関数のコードを保存するファイルの名前
+char *cache_path(Function *fn) {
+  unsigned long h = 0xcbf29ce484222325;
+  h = hash_string(h, CACHE_VERSION);
+  h = hash_int(h, unroll_factor);
+  h = hash_int(h, unroll_budget);
+  h = hash_bytes(h, fn->src, fn->src_len);
+  for (Node *n = fn->node; n; n = n->next)
+    h = hash_globals(h, n);
+
+  char buf[4096];
+  snprintf(buf, sizeof(buf), "%s/%016lx.s", cache_dir, h);
+  return duplicate_string_n(buf, strlen(buf));
+}
+
+// ファイルから行のリストを読み込む。ファイルがなければNULLを返す
+Insn *read_cache(char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return NULL;
+
+  Insn head = {0};
+  Insn *cur = &head;
+  char *line = NULL;
+  size_t cap = 0;
+  for (ssize_t len; (len = getline(&line, &cap, fp)) > 0;) {
+    if (line[len - 1] == '\n')
+      len--;
+    cur = cur->next = calloc(1, sizeof(Insn));
+    cur->text = duplicate_string_n(line, len);
+  }
+  free(line);
+  fclose(fp);
+  return head.next;
+}
+
+// 最適化の前に、各関数のコードをキャッシュから探す。
+// 見つかった関数はfn->cachedにコードを持ち、最適化とコード生成を省く
+void load_cache(Program *prog) {
+  if (!cache_dir)
+    return;
+  mkdir(cache_dir, 0777);
+
+  for (Function *fn = prog->fns; fn; fn = fn->next) {
+    fn->cache_path = cache_path(fn);
+    Insn *list = read_cache(fn->cache_path);
+
+    // ハッシュ値が衝突していないか、最初の行の関数名で確かめる
+    char globl[256];
+    snprintf(globl, sizeof(globl), ".globl %s", fn->name);
+    if (list && !strcmp(list->text, globl))
+      fn->cached = list;
+  }
+}
+
+// 生成した関数のコードをキャッシュに保存する。
+// 一時ファイルに書いてから名前を変えるので、同時に実行しても壊れない
+void store_cache(Function *fn, Insn *list) {
+  if (!fn->cache_path || fn->cached)
+    return;
+
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.XXXXXX", fn->cache_path);
+  int fd = mkstemp(tmp);
+  if (fd < 0)
+    return;
+  FILE *fp = fdopen(fd, "w");
+  for (Insn *insn = list; insn; insn = insn->next)
+    fprintf(fp, "%s\n", insn->text);
+  if (fclose(fp) || rename(tmp, fn->cache_path))
+    unlink(tmp);
+}
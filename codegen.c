@@ -1,138 +1,1129 @@
 #include "he3cc.h"
 
-// 制御構文でジャンプするためのラベルの通し番号
-int labelseq = 0;
+#include <pthread.h>
+#include <unistd.h>
+
+// 関数ごとのコード生成は複数のスレッドで並列に行う。
+// 生成中の関数についての状態はスレッドローカルに持つ
+
+// 関数を並列にコード生成するスレッドの数 (0ならCPUの数、1なら並列化しない)
+int codegen_threads;
+
+// 制御構文でジャンプするためのラベルの通し番号 (関数ごとに0から数える)
+// ラベル名には関数名を含めるので、関数をまたいで重複しない
+_Thread_local int labelseq;
+
+// breakで抜ける先の.L.breakラベルの番号 (ループやswitch文の外では-1)
+_Thread_local int brkseq = -1;
 
 // 現在コード生成中の関数名
-char *func_name;
+_Thread_local char *func_name;
 
 // 引数を格納するレジスタの名前
 char *argreg1[] = {"w0", "w1", "w2", "w3", "w4", "w5", "w6", "w7"};
 char *argreg8[] = {"x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7"};
 
+// 呼び出し先保存レジスタの名前
+// 関数内で使ったものだけをプロローグで退避し、エピローグで復元する
+char *callee_saved_regs[] = {"x19", "x20", "x21", "x22", "x23",
+                             "x24", "x25", "x26", "x27", "x28"};
+
+// 関数内で参照される変数
+// 参照の多いものから呼び出し先保存レジスタを割り当てる:
+//   ローカル変数: 値そのものをレジスタに置く
+//   グローバル変数: アドレスをプロローグで一度だけ計算してレジスタに保持する
+typedef struct VarRef VarRef;
+struct VarRef {
+  VarRef *next;
+  Var *var;
+  int weight;      // 参照の重み (ループ内の参照は重く数える)
+  bool addr_taken; // アドレスを取られているか
+  bool in_memory;  // レジスタに置けないか
+  char *reg;       // 割り当てたレジスタ (NULLなら割り当てない)
+};
+
+// 現在コード生成中の関数が参照する変数のリスト
+_Thread_local VarRef *var_refs;
+
+// 現在コード生成中の関数が使う呼び出し先保存レジスタの数
+_Thread_local int num_saved_regs;
+
+// 出力待ちの行のリスト。関数ごとに溜めて、スケジューリングしてから出力する
+_Thread_local Insn *insns;
+_Thread_local Insn *insns_tail;
+
+// 出力した行を標準出力に書き出さずにためておくリストの末尾
+// (NULLなら書き出す)
+_Thread_local Insn *output_tail;
+
 void gen(Node *node);
 
+// printfと同じ書式で文字列を作る。長さに合わせて確保するので、
+// 関数名を含むラベルが長くても切れない
+char *format(char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+
+  char *buf = calloc(1, len + 1);
+  va_start(ap, fmt);
+  vsnprintf(buf, len + 1, fmt, ap);
+  va_end(ap);
+  return buf;
+}
+
+// 1行分のアセンブリを出力待ちのリストに追加する
+void emit(char *fmt, ...) {
+  char buf[512];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+
+  int len = strlen(buf);
+  if (len > 0 && buf[len - 1] == '\n')
+    buf[--len] = '\0';
+
+  Insn *insn = calloc(1, sizeof(Insn));
+  insn->text = duplicate_string_n(buf, len);
+  if (insns_tail)
+    insns_tail->next = insn;
+  else
+    insns = insn;
+  insns_tail = insn;
+}
+
+// 出力待ちの行を出力する
+void flush_insns(Insn *list) {
+  if (output_tail) {
+    output_tail->next = list;
+    while (output_tail->next)
+      output_tail = output_tail->next;
+  } else {
+    for (Insn *insn = list; insn; insn = insn->next)
+      printf("%s\n", insn->text);
+  }
+  insns = insns_tail = NULL;
+}
+
 void gen_push(char *register_name) {
-  printf("  str %s, [sp, -16]!\n", register_name); // sp -= 16; *sp = x0;
+  emit("  str %s, [sp, -16]!\n", register_name); // sp -= 16; *sp = x0;
 }
 
 void gen_pop(char *register_name) {
-  printf("  ldr %s, [sp], #16\n", register_name); // x0 = *sp; sp += 16;
+  emit("  ldr %s, [sp], #16\n", register_name); // x0 = *sp; sp += 16;
 }
 
-// ノードのアドレスをx0に格納し、スタックにpushする
-void gen_addr(Node *node) {
-  switch (node->kind) {
-  case ND_VAR: {
-    Var *var = node->var;
-    if (var->is_local) {
-      // ローカル変数:
-      // スタック上に配置されるため、フレームポインタ(x29)からの相対オフセットで参照
-      int offset = node->var->offset;
-      printf("  sub x0, x29, #%d\n", offset);
-    } else {
-      // グローバル変数:
-      // データセクションに配置されるため、ラベル経由でアドレスを取得
-      // ARM64の即値制限(12bit)により、64bitアドレスは2命令で構築:
-      //   1. adrp: 上位ビット（4KBページアドレス）
-      //   2. add :lo12:: 下位12bit（ページ内オフセット）
-      printf("  adrp x0, .L.%s\n", var->name);
-      printf("  add x0, x0, :lo12:.L.%s\n", var->name);
-    }
-    gen_push("x0");
+// 即値をレジスタに格納する
+// movの1命令で表せない値はmovz/movn + movkの列で16bitずつ組み立てる
+void gen_imm(char *register_name, long val) {
+  if (-65536 <= val && val < 65536) {
+    // mov (movz/movnの別名) で表現できる
+    emit("  mov %s, #%ld\n", register_name, val);
     return;
   }
+
+  // 0xffffの塊が多ければmovnを起点にして、movkの数を減らす
+  unsigned long v = val;
+  int ones = 0;
+  for (int shift = 0; shift < 64; shift += 16)
+    if (((v >> shift) & 0xffff) == 0xffff)
+      ones++;
+  unsigned long fill = (ones >= 2) ? 0xffff : 0;
+
+  bool first = true;
+  for (int shift = 0; shift < 64; shift += 16) {
+    unsigned long part = (v >> shift) & 0xffff;
+    if (part == fill)
+      continue;
+    if (first && fill)
+      emit("  movn %s, #%lu, lsl #%d\n", register_name, ~part & 0xffff, shift);
+    else if (first)
+      emit("  movz %s, #%lu, lsl #%d\n", register_name, part, shift);
+    else
+      emit("  movk %s, #%lu, lsl #%d\n", register_name, part, shift);
+    first = false;
+  }
+}
+
+// アドレスがレジスタに保持されているグローバル変数ならそのレジスタ名を返す
+char *global_addr_reg(Var *var) {
+  if (var->is_local)
+    return NULL;
+  for (VarRef *ref = var_refs; ref; ref = ref->next)
+    if (ref->var == var)
+      return ref->reg;
+  return NULL;
+}
+
+// レジスタに割り当てたローカル変数ならそのレジスタ名を返す
+char *var_reg(Node *node) {
+  if (node->kind == ND_VAR && node->var->is_local)
+    return node->var->reg;
+  return NULL;
+}
+
+// add/sub/cmpの即値オペランド(12bit符号なし)に収まるかどうか
+bool is_imm12(long val) { return 0 <= val && val < 4096; }
+
+// ノードが即値オペランドとして直接埋め込める整数定数かどうか
+bool is_imm_operand(Node *node) {
+  return node->kind == ND_NUM &&
+         is_imm12(node->val < 0 ? -node->val : node->val);
+}
+
+// dst = src + val を生成する。
+// 即値が12bitに収まらない場合はx16に値を組み立ててから加減算する
+void gen_add_imm(char *dst, char *src, long val) {
+  char *op = val < 0 ? "sub" : "add";
+  long mag = val < 0 ? -val : val;
+  if (is_imm12(mag)) {
+    emit("  %s %s, %s, #%ld\n", op, dst, src, mag);
+    return;
+  }
+  gen_imm("x16", mag);
+  emit("  %s %s, %s, x16\n", op, dst, src);
+}
+
+// アドレッシングモード
+//   [base, #offset]
+//   [base, index, lsl #shift]
+//   [base, :lo12:sym+offset] (baseにはadrpでsymのページアドレスを求める)
+typedef struct {
+  char *base;  // ベースレジスタ
+  char *index; // インデックスレジスタ (NULLなら即値オフセット)
+  int shift;   // インデックスの左シフト量
+  long offset; // 即値オフセット
+  char *sym;   // ページ内オフセットを :lo12: で埋め込むシンボル
+} Addr;
+
+// x0とx16以外のレジスタを壊さずにx0へ評価できる式かどうか
+// (定数・変数・変数のアドレス)
+bool is_leaf(Node *node) {
+  if (node->kind == ND_ADDR)
+    return node->lhs->kind == ND_VAR;
+  return node->kind == ND_NUM || node->kind == ND_VAR;
+}
+
+// nが2のべき乗ならその指数を、そうでなければ-1を返す
+int log2_exact(long n) {
+  for (int i = 0; i < 63; i++)
+    if (n == 1L << i)
+      return i;
+  return -1;
+}
+
+// ロード/ストア命令のアクセスサイズ
+int access_size(Type *ty) { return size_of(ty) == 1 ? 1 : 8; }
+
+// 変数のアドレッシングモード。
+// アドレスがレジスタに無いグローバル変数は、adrpでページアドレスをtmpに求める
+Addr var_addr(Var *var, char *tmp) {
+  Addr addr = {0};
+  if (var->is_local) {
+    // ローカル変数: フレームポインタ(x29)からの相対オフセットで参照
+    addr.base = "x29";
+    addr.offset = -var->offset;
+  } else if (global_addr_reg(var)) {
+    // プロローグで計算済みのアドレスを使う
+    addr.base = global_addr_reg(var);
+  } else {
+    // グローバル変数:
+    // ARM64の即値制限(12bit)により、64bitアドレスは2つに分けて構築:
+    //   1. adrp: 上位ビット（4KBページアドレス）
+    //   2. :lo12:: 下位12bit（ページ内オフセット）
+    addr.base = tmp;
+    addr.sym = var->name;
+  }
+  return addr;
+}
+
+// :lo12: に埋め込むシンボル式 (.L.name+offset)
+char *sym_expr(Addr *addr) {
+  static _Thread_local char buf[256];
+  if (addr->offset)
+    snprintf(buf, sizeof(buf), ".L.%s%+ld", addr->sym, addr->offset);
+  else
+    snprintf(buf, sizeof(buf), ".L.%s", addr->sym);
+  return buf;
+}
+
+// アドレッシングモードが指すアドレスをレジスタdstに求める
+void gen_lea(char *dst, Addr *addr) {
+  if (addr->sym) {
+    char *sym = sym_expr(addr);
+    emit("  adrp %s, %s\n", dst, sym);
+    emit("  add %s, %s, :lo12:%s\n", dst, dst, sym);
+    return;
+  }
+
+  char *base = addr->base;
+  if (addr->index) {
+    if (addr->shift)
+      emit("  add %s, %s, %s, lsl #%d\n", dst, base, addr->index, addr->shift);
+    else
+      emit("  add %s, %s, %s\n", dst, base, addr->index);
+    base = dst;
+  }
+  if (addr->offset || strcmp(base, dst))
+    gen_add_imm(dst, base, addr->offset);
+}
+
+// インデックスをベースに足し込み、即値オフセットを付けられる形にする
+void fold_index(Addr *addr) {
+  if (!addr->index)
+    return;
+  gen_lea(addr->base, addr);
+  addr->index = NULL;
+  addr->shift = 0;
+  addr->offset = 0;
+}
+
+// ロード/ストア命令のメモリオペランドを作る。
+// アクセスサイズがsizeのとき、オフセットが命令に収まらなければx16にアドレスを求める
+char *mem_operand(Addr *addr, int size) {
+  static _Thread_local char buf[256];
+
+  if (addr->sym) {
+    char *sym = sym_expr(addr);
+    emit("  adrp %s, %s\n", addr->base, sym);
+    snprintf(buf, sizeof(buf), "[%s, :lo12:%s]", addr->base, sym);
+    return buf;
+  }
+
+  if (addr->index) {
+    if (addr->shift)
+      snprintf(buf, sizeof(buf), "[%s, %s, lsl #%d]", addr->base, addr->index,
+               addr->shift);
+    else
+      snprintf(buf, sizeof(buf), "[%s, %s]", addr->base, addr->index);
+    return buf;
+  }
+
+  // ldur/stur (9bit符号付き) か、ldr/str (12bit符号なし・サイズ倍) で表せるか
+  long off = addr->offset;
+  if ((-256 <= off && off < 256) ||
+      (off >= 0 && off % size == 0 && off / size < 4096)) {
+    if (off)
+      snprintf(buf, sizeof(buf), "[%s, #%ld]", addr->base, off);
+    else
+      snprintf(buf, sizeof(buf), "[%s]", addr->base);
+    return buf;
+  }
+
+  gen_add_imm("x16", addr->base, off);
+  return "[x16]";
+}
+
+Addr gen_addr_mode(Node *node, char *tmp);
+
+// アドレスの計算に実行時の評価が要らない左辺値かどうか
+// (変数と、配列変数を定数で添字付けしたもの)
+bool is_static_ptr(Node *ptr) {
+  if (ptr->ty->kind == TY_ARRAY && ptr->kind == ND_VAR)
+    return true;
+  if (ptr->ty->kind == TY_ARRAY && ptr->kind == ND_DEREF)
+    return is_static_ptr(ptr->lhs);
+  if ((ptr->kind == ND_ADD || ptr->kind == ND_SUB) && ptr->ty->base &&
+      ptr->rhs->kind == ND_NUM)
+    return is_static_ptr(ptr->lhs);
+  return false;
+}
+
+bool is_static_addr(Node *node) {
+  if (node->kind == ND_VAR)
+    return true;
+  return node->kind == ND_DEREF && is_static_ptr(node->lhs);
+}
+
+// ポインタ式ptrが指す先のアドレッシングモードを選択する。
+// sizeは最終的なロード/ストアのアクセスサイズ (0ならアクセスしない)
+Addr gen_ptr_addr(Node *ptr, int size, char *tmp) {
+  // 配列はその左辺値のアドレスが先頭要素へのポインタになる
+  if (ptr->ty->kind == TY_ARRAY &&
+      (ptr->kind == ND_VAR || ptr->kind == ND_DEREF))
+    return gen_addr_mode(ptr, tmp);
+
+  if ((ptr->kind == ND_ADD || ptr->kind == ND_SUB) && ptr->ty->base) {
+    long elem = size_of(ptr->ty->base);
+    Node *idx = ptr->rhs;
+
+    // p+定数: 即値オフセットに畳み込む
+    if (idx->kind == ND_NUM) {
+      Addr addr = gen_ptr_addr(ptr->lhs, 0, tmp);
+      fold_index(&addr);
+      if (ptr->kind == ND_ADD)
+        addr.offset += idx->val * elem;
+      else
+        addr.offset -= idx->val * elem;
+      return addr;
+    }
+
+    if (ptr->kind == ND_ADD) {
+      // p+i: ベースをレジスタ (通常はx1)、インデックスをx0に置く
+      Addr base = gen_ptr_addr(ptr->lhs, 0, "x0");
+      char *reg = "x1";
+      if (!base.sym && !base.index && !base.offset &&
+          strcmp(base.base, "x0") && strcmp(base.base, "x1")) {
+        // x29や呼び出し先保存レジスタは式の評価で壊れないのでそのまま使う
+        reg = base.base;
+        gen(idx);
+      } else if (is_leaf(idx)) {
+        gen_lea("x1", &base);
+        gen(idx);
+      } else {
+        gen_lea("x0", &base);
+        gen_push("x0");
+        gen(idx);
+        gen_pop("x1");
+      }
+
+      Addr addr = {.base = reg};
+      int shift = log2_exact(elem);
+      if (elem == 1 || (size && elem == size)) {
+        // 要素サイズがアクセスサイズと一致すればレジスタオフセット形式を使う
+        addr.index = "x0";
+        addr.shift = shift;
+      } else if (shift >= 0) {
+        emit("  add x1, %s, x0, lsl #%d\n", reg, shift);
+        addr.base = "x1";
+      } else {
+        gen_imm("x16", elem);
+        emit("  madd x1, x0, x16, %s\n", reg);
+        addr.base = "x1";
+      }
+      return addr;
+    }
+  }
+
+  // それ以外: ポインタの値をそのままベースにする
+  if (var_reg(ptr))
+    return (Addr){.base = var_reg(ptr)};
+  gen(ptr);
+  return (Addr){.base = "x0"};
+}
+
+// 左辺値nodeのアドレッシングモードを選択し、必要なアドレス計算を生成する。
+// 静的なアドレスのadrpにはtmpを使う
+Addr gen_addr_mode(Node *node, char *tmp) {
+  switch (node->kind) {
+  case ND_VAR:
+    return var_addr(node->var, tmp);
   case ND_DEREF:
     // *ptr: ptrの値がアドレスそのもの
-    gen(node->lhs);
-    return;
+    return gen_ptr_addr(node->lhs,
+                        node->ty->kind == TY_ARRAY ? 0 : access_size(node->ty),
+                        tmp);
   default:
     break;
   }
 
   error_tok(node->tok, "代入の左辺値が変数ではありません");
+  return (Addr){0};
 }
 
-void gen_lval(Node *node) {
+// アドレッシングモードがx0を参照しないようにする
+// (x0を値の評価に使うため)
+void keep_off_x0(Addr *addr) {
+  if (addr->index && !strcmp(addr->index, "x0")) {
+    emit("  mov x2, x0\n");
+    addr->index = "x2";
+  }
+  if (!strcmp(addr->base, "x0")) {
+    emit("  mov x1, x0\n");
+    addr->base = "x1";
+  }
+}
+
+// ノードのアドレスをx0に格納する
+void gen_addr(Node *node) {
+  Addr addr = gen_addr_mode(node, "x0");
+  gen_lea("x0", &addr);
+}
+
+// 代入の左辺値として使えるか確認する
+void check_lval(Node *node) {
   if (node->ty->kind == TY_ARRAY) {
     error_tok(node->tok, "配列は代入の左辺値になれません");
   }
-  gen_addr(node);
 }
 
-// スタックトップにあるアドレスから値をロードして、値をスタックにプッシュする
-void load(Type *ty) {
-  gen_pop("x0"); // スタックからアドレスを取り出してx0にロード
+// メモリオペランドmemから値をロードしてレジスタregに格納する
+void load_to(char *reg, Type *ty, char *mem) {
   if (size_of(ty) == 1) {
-    printf("  ldrsb w0, [x0]\n"); // 1バイトレジスタ
+    emit("  ldrsb %s, %s\n", reg, mem); // 1バイトを符号拡張
   } else {
-    printf("  ldr x0, [x0]\n"); // 8バイトレジスタ
+    emit("  ldr %s, %s\n", reg, mem); // 8バイトレジスタ
   }
-  gen_push("x0"); // x0をスタックにプッシュ
 }
 
-// スタックトップにある値をスタック2番目にあるアドレスにストアして、値を再びスタックにプッシュする
-void store(Type *ty) {
-  gen_pop("x1"); // スタックから値を取り出してx1にロード
-  gen_pop("x0"); // スタックからアドレスを取り出してx0にロード
+// メモリオペランドmemから値をロードしてx0に格納する
+void load_from(Type *ty, char *mem) { load_to("x0", ty, mem); }
 
+// レジスタregにある値をメモリオペランドmemにストアする
+void store_reg(char *reg, Type *ty, char *mem) {
   if (size_of(ty) == 1) {
-    printf("  strb w1, [x0]\n"); // 1バイトストア
+    emit("  strb w%s, %s\n", reg + 1, mem); // 1バイトストア
   } else {
-    printf("  str x1, [x0]\n"); // 8バイトストア
+    emit("  str %s, %s\n", reg, mem); // 8バイトストア
   }
-  gen_push("x1"); // x1をスタックにプッシュ
 }
 
-void gen(Node *node) {
-  switch (node->kind) {
-  case ND_NULL:
+// x0にある値をメモリオペランドmemにストアする。値はx0に残る
+void store_to(Type *ty, char *mem) { store_reg("x0", ty, mem); }
+
+// レジスタsrcの値を、レジスタに割り当てた変数dstに代入する。
+// char型は1バイトに切り詰めて符号拡張する
+void move_to_var(char *dst, Type *ty, char *src) {
+  if (size_of(ty) == 1)
+    emit("  sxtb %s, w%s\n", dst, src + 1);
+  else
+    emit("  mov %s, %s\n", dst, src);
+}
+
+// 左辺値nodeから値をロードしてx0に格納する
+void gen_load(Node *node) {
+  Addr addr = gen_addr_mode(node, "x0");
+  load_from(node->ty, mem_operand(&addr, access_size(node->ty)));
+}
+
+// 単純な式node (is_leaf) の値を、x16以外を壊さずにレジスタregへ直接評価する
+void gen_leaf(char *reg, Node *node) {
+  if (node->kind == ND_NUM) {
+    gen_imm(reg, node->val);
     return;
-  case ND_NUM:
-    printf("  mov x0,  #%d\n", node->val);
-    gen_push("x0");
+  }
+  if (var_reg(node)) {
+    emit("  mov %s, %s\n", reg, var_reg(node));
     return;
-  case ND_EXPR_STMT:
-    gen(node->lhs);
-    // 式文は結果を返さない
-    printf(
-        "  add sp, sp, #16\n"); // スタックポインタを16バイト上げる (領域解放)
+  }
+
+  // 変数のアドレス、または配列 (先頭要素へのポインタ)
+  Node *var = node->kind == ND_ADDR ? node->lhs : node;
+  Addr addr = var_addr(var->var, reg);
+  if (node->kind == ND_ADDR || node->ty->kind == TY_ARRAY) {
+    gen_lea(reg, &addr);
     return;
-  case ND_VAR:
-    gen_addr(node);
-    if (node->ty->kind != TY_ARRAY) {
-      load(node->ty);
+  }
+  load_to(reg, node->ty, mem_operand(&addr, access_size(node->ty)));
+}
+
+// 式の中に関数呼び出しを含むかどうか
+// (含まなければ、評価で壊れるのはx0〜x2とx16, x17だけ)
+bool has_call(Node *node) {
+  if (!node)
+    return false;
+  if (node->kind == ND_FUN_CALL)
+    return true;
+  Node **slots[MAX_CHILDREN];
+  int nslots = child_slots(node, slots);
+  for (int i = 0; i < nslots; i++)
+    for (Node *n = *slots[i]; n; n = n->next)
+      if (has_call(n))
+        return true;
+  return false;
+}
+
+// 関数呼び出しを生成する。戻り値はx0に入る
+//
+// 引数は次の順で評価する:
+//   1. 関数呼び出しを含む引数: 他の引数レジスタを壊すので先に評価してスタックに積む
+//   2. それ以外の複雑な引数: x0に評価して引数レジスタへ移す。
+//      評価で壊れるx0〜x2向けの値は、いったんx9〜x11に置く
+//   3. 1の値をスタックから引数レジスタに戻す
+//   4. 単純な引数 (定数・変数): 引数レジスタへ直接ロードする
+// 9個目以降の引数はAAPCS64に従い、呼び出し時のspから8バイトずつ並べる
+void gen_funcall(Node *node) {
+  int nargs = 0;
+  for (Node *arg = node->args; arg; arg = arg->next)
+    nargs++;
+
+  Node **args = calloc(nargs, sizeof(Node *));
+  int i = 0;
+  for (Node *arg = node->args; arg; arg = arg->next)
+    args[i++] = arg;
+
+  // スタック渡しの引数領域を確保する
+  int nregs = nargs < 8 ? nargs : 8;
+  int stack_size = align_to((nargs - nregs) * 8, 16);
+  if (stack_size)
+    gen_add_imm("sp", "sp", -stack_size);
+
+  // depth: スタック渡し領域より上に積んだ値のバイト数
+  int depth = 0;
+  for (int i = 0; i < nargs; i++) {
+    if (!has_call(args[i]))
+      continue;
+    gen(args[i]);
+    if (i < 8) {
+      gen_push("x0");
+      depth += 16;
+    } else {
+      emit("  str x0, [sp, #%d]\n", depth + (i - 8) * 8);
     }
+  }
+
+  for (int i = 0; i < nargs; i++) {
+    if (has_call(args[i]) || (i < 8 && is_leaf(args[i])))
+      continue;
+    gen(args[i]);
+    if (i < 3)
+      emit("  mov x%d, x0\n", 9 + i);
+    else if (i < 8)
+      emit("  mov %s, x0\n", argreg8[i]);
+    else
+      emit("  str x0, [sp, #%d]\n", depth + (i - 8) * 8);
+  }
+
+  for (int i = nregs - 1; i >= 0; i--)
+    if (has_call(args[i]))
+      gen_pop(argreg8[i]);
+
+  for (int i = 0; i < nregs; i++) {
+    if (has_call(args[i]))
+      continue;
+    if (is_leaf(args[i]))
+      gen_leaf(argreg8[i], args[i]);
+    else if (i < 3)
+      emit("  mov %s, x%d\n", argreg8[i], 9 + i);
+  }
+
+  emit("  bl %s\n", node->func_name);
+
+  if (stack_size)
+    gen_add_imm("sp", "sp", stack_size);
+}
+
+// 代入 lhs = rhs を生成する。値はx0に残る
+void gen_store(Node *lhs, Node *rhs) {
+  check_lval(lhs);
+  int size = access_size(lhs->ty);
+
+  if (var_reg(lhs)) {
+    gen(rhs);
+    move_to_var(var_reg(lhs), lhs->ty, "x0");
     return;
-  case ND_ASSIGN:
-    gen_lval(node->lhs);
+  }
+
+  // アドレスが静的に決まるなら、右辺を先に評価してから直接ストアする
+  if (is_static_addr(lhs)) {
+    gen(rhs);
+    Addr addr = gen_addr_mode(lhs, "x1");
+    store_to(lhs->ty, mem_operand(&addr, size));
+    return;
+  }
+
+  // 右辺が単純ならアドレッシングモードをレジスタに残したまま評価する
+  if (is_leaf(rhs)) {
+    Addr addr = gen_addr_mode(lhs, "x1");
+    keep_off_x0(&addr);
+    gen(rhs);
+    store_to(lhs->ty, mem_operand(&addr, size));
+    return;
+  }
+
+  // それ以外はアドレスをスタックに退避する
+  gen_addr(lhs);
+  gen_push("x0");
+  gen(rhs);
+  gen_pop("x1");
+  store_to(lhs->ty, "[x1]");
+}
+
+// 比較演算kindに対応する条件コードを返す。negateなら否定した条件を返す
+char *cond_code(NodeKind kind, bool negate) {
+  switch (kind) {
+  case ND_EQ:
+    return negate ? "ne" : "eq";
+  case ND_NE:
+    return negate ? "eq" : "ne";
+  case ND_LT:
+    return negate ? "ge" : "lt";
+  case ND_LE:
+    return negate ? "gt" : "le";
+  case ND_GT:
+    return negate ? "le" : "gt";
+  case ND_GE:
+    return negate ? "lt" : "ge";
+  default:
+    error("不正な比較演算です");
+    return NULL;
+  }
+}
+
+bool is_compare(Node *node) {
+  switch (node->kind) {
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+  case ND_GT:
+  case ND_GE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// 比較結果をx0に0/1で格納する
+void gen_cset(NodeKind kind) {
+  emit("  cset x0, %s\n", cond_code(kind, false));
+}
+
+// レジスタregと定数valを比較する。
+// 負の即値はcmnで比較し、12bitに収まらない値はx16に組み立てる
+void gen_cmp_imm(char *reg, long val) {
+  if (is_imm12(val)) {
+    emit("  cmp %s, #%ld\n", reg, val);
+  } else if (is_imm12(-val)) {
+    emit("  cmn %s, #%ld\n", reg, -val);
+  } else {
+    gen_imm("x16", val);
+    emit("  cmp %s, x16\n", reg);
+  }
+}
+
+// caseを値の昇順に並べるための比較関数
+int compare_case(const void *a, const void *b) {
+  Node *x = *(Node **)a;
+  Node *y = *(Node **)b;
+  return (x->val > y->val) - (x->val < y->val);
+}
+
+// 昇順に並んだcaseの値が、ジャンプテーブルを作るのに十分密集しているか。
+// 4個以上あり、値の範囲の1/3以上が埋まっていれば表引きにする
+bool is_dense_cases(Node **cases, int ncases) {
+  if (ncases < 4)
+    return false;
+  long range = (long)cases[ncases - 1]->val - cases[0]->val + 1;
+  return range <= ncases * 3L;
+}
+
+// x0の値でジャンプテーブルを引いて分岐する。
+// テーブルには表の先頭からcaseのラベルまでの距離を4バイトで並べる
+void gen_jump_table(Node **cases, int ncases, char *dflt) {
+  int seq = labelseq++;
+  long min = cases[0]->val;
+  long max = cases[ncases - 1]->val;
+
+  // x0 - min を符号なしで比較すれば、範囲の上下を一度に判定できる
+  if (min)
+    gen_add_imm("x0", "x0", -min);
+  gen_cmp_imm("x0", max - min);
+  emit("  b.hi %s\n", dflt);
+
+  emit("  adr x1, .L.jump.%s.%d\n", func_name, seq);
+  emit("  ldrsw x2, [x1, x0, lsl #2]\n");
+  emit("  add x1, x1, x2\n");
+  emit("  br x1\n");
+
+  emit(".L.jump.%s.%d:\n", func_name, seq);
+  int i = 0;
+  for (long v = min; v <= max; v++) {
+    if (cases[i]->val == v)
+      emit("  .word .L.case.%s.%d - .L.jump.%s.%d\n", func_name,
+           cases[i++]->case_label, func_name, seq);
+    else
+      emit("  .word %s - .L.jump.%s.%d\n", dflt, func_name, seq);
+  }
+}
+
+// x0の値とcases[lo..hi]を比較して、一致するcaseに分岐する。
+// 数が少なければ順に比較し、多ければ中央の値で二分探索する
+void gen_case_search(Node **cases, int lo, int hi, char *dflt) {
+  if (hi - lo < 4) {
+    for (int i = lo; i <= hi; i++) {
+      gen_cmp_imm("x0", cases[i]->val);
+      emit("  b.eq .L.case.%s.%d\n", func_name, cases[i]->case_label);
+    }
+    emit("  b %s\n", dflt);
+    return;
+  }
+
+  int mid = (lo + hi) / 2;
+  int seq = labelseq++;
+  gen_cmp_imm("x0", cases[mid]->val);
+  emit("  b.eq .L.case.%s.%d\n", func_name, cases[mid]->case_label);
+  emit("  b.gt .L.case.upper.%s.%d\n", func_name, seq);
+  gen_case_search(cases, lo, mid - 1, dflt);
+  emit(".L.case.upper.%s.%d:\n", func_name, seq);
+  gen_case_search(cases, mid + 1, hi, dflt);
+}
+
+// 式nodeを評価し、値の入ったレジスタ名を返す。
+// レジスタに割り当てた変数なら何も生成せずにそのレジスタを返す
+char *gen_operand(Node *node) {
+  if (var_reg(node))
+    return var_reg(node);
+  gen(node);
+  return "x0";
+}
+
+// 単純な式nodeの値をregに読み込み、値の入ったレジスタ名を返す
+char *gen_leaf_operand(char *reg, Node *node) {
+  if (var_reg(node))
+    return var_reg(node);
+  gen_leaf(reg, node);
+  return reg;
+}
+
+// 二項演算nodeの左辺と右辺を評価し、それぞれの値の入ったレジスタ名を
+// lhs, rhsに返す。
+// どちらかが単純な式なら、もう片方を評価した後で直接レジスタに読み込む
+void gen_operands(Node *node, char **lhs, char **rhs) {
+  if (is_leaf(node->rhs)) {
+    *lhs = gen_operand(node->lhs);
+    *rhs = gen_leaf_operand("x1", node->rhs);
+  } else if (is_leaf(node->lhs)) {
+    *rhs = gen_operand(node->rhs);
+    *lhs = gen_leaf_operand("x1", node->lhs);
+  } else {
+    gen(node->lhs);
+    gen_push("x0");
     gen(node->rhs);
-    store(node->ty);
-    return;
-  case ND_FUN_CALL: {
-    // 現状、引数は8個まで対応
-    int num_args = 0;
-    for (Node *arg = node->args; arg; arg = arg->next) {
-      gen(arg);
-      num_args++;
+    gen_pop("x1");
+    *lhs = "x1";
+    *rhs = "x0";
+  }
+}
+
+// 比較演算nodeの両辺を比較し、結果をフラグに残す
+void gen_compare(Node *node) {
+  if (is_imm_operand(node->rhs)) {
+    gen_cmp_imm(gen_operand(node->lhs), node->rhs->val);
+    return;
+  }
+  char *lhs, *rhs;
+  gen_operands(node, &lhs, &rhs);
+  emit("  cmp %s, %s\n", lhs, rhs);
+}
+
+// 条件式nodeの真偽がwhenに一致すればlabelに分岐し、そうでなければ
+// 次の命令に進むコードを生成する。
+// &&と||は右辺を評価せずに分岐することで短絡評価する
+void gen_branch(Node *node, bool when, char *label) {
+  switch (node->kind) {
+  case ND_LOGAND:
+  case ND_LOGOR: {
+    // a && b が偽になる/a || b が真になるのは、左辺だけで決まる場合がある
+    bool is_and = node->kind == ND_LOGAND;
+    if (when != is_and) {
+      gen_branch(node->lhs, when, label);
+      gen_branch(node->rhs, when, label);
+      return;
     }
+    char *skip = format(".L.cond.skip.%s.%d", func_name, labelseq++);
+    gen_branch(node->lhs, !when, skip);
+    gen_branch(node->rhs, when, label);
+    emit("%s:\n", skip);
+    return;
+  }
+  case ND_NOT:
+    gen_branch(node->lhs, !when, label);
+    return;
+  default:
+    break;
+  }
 
-    // スタックから逆順でポップして引数レジスタにセット
-    for (int i = num_args - 1; i >= 0; i--) {
-      gen_pop(argreg8[i]);
+  // 比較はフラグを直接見て分岐する
+  if (is_compare(node)) {
+    gen_compare(node);
+    emit("  b.%s %s\n", cond_code(node->kind, !when), label);
+    return;
+  }
+
+  char *reg = gen_operand(node);
+  emit("  %s %s, %s\n", when ? "cbnz" : "cbz", reg, label);
+}
+
+// 型tyの値に対する加減算 (kind) の右辺rhsが、add/subの即値に
+// 埋め込める定数なら、その加算量を*valに格納して真を返す
+bool add_imm_operand(NodeKind kind, Type *ty, Node *rhs, long *val) {
+  if ((kind != ND_ADD && kind != ND_SUB) || rhs->kind != ND_NUM)
+    return false;
+
+  // ポインタ型の場合、スケーリング済みの値を埋め込む
+  long v = rhs->val;
+  if (ty->base)
+    v *= size_of(ty->base);
+  if (kind == ND_SUB)
+    v = -v;
+  if (!is_imm12(v < 0 ? -v : v))
+    return false;
+  *val = v;
+  return true;
+}
+
+// dst = src + val (valはadd_imm_operandで求めた加算量)
+void gen_add_small(char *dst, char *src, long val) {
+  if (val < 0)
+    emit("  sub %s, %s, #%ld\n", dst, src, -val);
+  else
+    emit("  add %s, %s, #%ld\n", dst, src, val);
+}
+
+// 型tyの算術演算 dst = lhs op rhs を生成する (opはND_ADD, ND_SUB, ND_MUL,
+// ND_DIV)。ポインタの加減算で要素サイズが2のべき乗でなければtmpを使う
+void gen_arith(NodeKind op, Type *ty, char *dst, char *lhs, char *rhs,
+               char *tmp) {
+  switch (op) {
+  case ND_ADD:
+  case ND_SUB: {
+    char *insn = op == ND_ADD ? "add" : "sub";
+    if (!ty->base) {
+      emit("  %s %s, %s, %s\n", insn, dst, lhs, rhs);
+      return;
     }
 
-    // 関数呼び出し
-    printf("  bl %s\n", node->func_name);
+    // ポインタ型の場合、スケーリングする
+    long elem = size_of(ty->base);
+    int shift = log2_exact(elem);
+    if (shift >= 0) {
+      emit("  %s %s, %s, %s, lsl #%d\n", insn, dst, lhs, rhs, shift);
+    } else {
+      gen_imm(tmp, elem);
+      emit("  m%s %s, %s, %s, %s\n", insn, dst, rhs, tmp, lhs);
+    }
+    return;
+  }
+  case ND_MUL:
+    emit("  mul %s, %s, %s\n", dst, lhs, rhs);
+    return;
+  case ND_DIV:
+    emit("  sdiv %s, %s, %s\n", dst, lhs, rhs);
+    return;
+  default:
+    return;
+  }
+}
+
+// 条件式nodeを評価して結果をフラグに残し、真を表す条件コードを返す
+char *gen_cond_flags(Node *node) {
+  if (is_compare(node)) {
+    gen_compare(node);
+    return cond_code(node->kind, false);
+  }
+  if (node->kind == ND_NOT && is_compare(node->lhs)) {
+    gen_compare(node->lhs);
+    return cond_code(node->lhs->kind, true);
+  }
+  emit("  cmp %s, #0\n", gen_operand(node));
+  return "ne";
+}
 
-    // 戻り値をスタックにプッシュ
+// 条件の否定を表す条件コード
+char *invert_cc(char *cc) {
+  static char *pairs[][2] = {{"eq", "ne"}, {"lt", "ge"}, {"le", "gt"}};
+  for (int i = 0; i < 3; i++) {
+    if (!strcmp(cc, pairs[i][0]))
+      return pairs[i][1];
+    if (!strcmp(cc, pairs[i][1]))
+      return pairs[i][0];
+  }
+  error("不正な条件コードです: %s", cc);
+  return NULL;
+}
+
+// nodeが変数varに定数1を足す式かどうか
+bool is_var_plus_one(Node *node, Node *var) {
+  return node->kind == ND_ADD && !node->ty->base && node->lhs->kind == ND_VAR &&
+         node->lhs->var == var->var && node->rhs->kind == ND_NUM &&
+         node->rhs->val == 1;
+}
+
+// 条件演算子 cond ? then : els を分岐なしで生成する。
+// 比較でフラグを立ててから両辺を評価し、cset/csinc/cselで選ぶ
+// (両辺はis_speculatableで、評価がフラグを壊さないこと)
+void gen_select(Node *node) {
+  char *cc = gen_cond_flags(node->cond);
+  Node *then = node->then;
+  Node *els = node->els;
+
+  // c ? 1 : 0 / c ? 0 : 1
+  if (then->kind == ND_NUM && els->kind == ND_NUM) {
+    if (then->val == 1 && els->val == 0) {
+      emit("  cset x0, %s\n", cc);
+      return;
+    }
+    if (then->val == 0 && els->val == 1) {
+      emit("  cset x0, %s\n", invert_cc(cc));
+      return;
+    }
+  }
+
+  // c ? x : x+1 / c ? x+1 : x
+  if (then->kind == ND_VAR && is_var_plus_one(els, then)) {
+    char *x = gen_leaf_operand("x0", then);
+    emit("  csinc x0, %s, %s, %s\n", x, x, cc);
+    return;
+  }
+  if (els->kind == ND_VAR && is_var_plus_one(then, els)) {
+    char *x = gen_leaf_operand("x0", els);
+    emit("  csinc x0, %s, %s, %s\n", x, x, invert_cc(cc));
+    return;
+  }
+
+  // 定数0はゼロレジスタで表す
+  char *t, *e;
+  if (then->kind == ND_NUM && then->val == 0) {
+    t = "xzr";
+    e = gen_operand(els);
+  } else if (els->kind == ND_NUM && els->val == 0) {
+    e = "xzr";
+    t = gen_operand(then);
+  } else if (is_leaf(then)) {
+    e = gen_operand(els);
+    t = gen_leaf_operand("x1", then);
+  } else if (is_leaf(els)) {
+    t = gen_operand(then);
+    e = gen_leaf_operand("x1", els);
+  } else {
+    gen(then);
     gen_push("x0");
+    gen(els);
+    gen_pop("x1");
+    t = "x1";
+    e = "x0";
+  }
+  emit("  csel x0, %s, %s, %s\n", t, e, cc);
+}
+
+// 右辺が即値の二項演算を x0 = x0 op #imm の形で生成する。
+// 即値で表せない場合は偽を返す
+bool gen_binary_imm(Node *node) {
+  long val;
+  if (!add_imm_operand(node->kind, node->ty, node->rhs, &val))
+    return false;
+  gen_add_small("x0", gen_operand(node->lhs), val);
+  return true;
+}
+
+// 複合代入・インクリメント/デクリメントの演算の種類
+NodeKind assign_op_kind(NodeKind kind) {
+  switch (kind) {
+  case ND_ADD_ASSIGN:
+  case ND_POST_INC:
+    return ND_ADD;
+  case ND_SUB_ASSIGN:
+  case ND_POST_DEC:
+    return ND_SUB;
+  case ND_MUL_ASSIGN:
+    return ND_MUL;
+  case ND_DIV_ASSIGN:
+    return ND_DIV;
+  default:
+    return ND_NULL;
+  }
+}
+
+// 複合代入 lhs op= rhs と後置インクリメント/デクリメントを生成する。
+// 左辺のアドレスは一度だけ計算し、ロード・演算・ストアを1回ずつ行う。
+// レジスタに割り当てた変数はレジスタ上で直接更新する。
+// want_valueなら式の値 (後置なら更新前の値) をx0に残す
+void gen_assign_op(Node *node, bool want_value) {
+  Node *lhs = node->lhs;
+  Node *rhs = node->rhs;
+  Type *ty = lhs->ty;
+  NodeKind op = assign_op_kind(node->kind);
+  bool post = node->kind == ND_POST_INC || node->kind == ND_POST_DEC;
+  check_lval(lhs);
+
+  long imm;
+  bool is_imm = add_imm_operand(op, ty, rhs, &imm);
+
+  char *reg = var_reg(lhs);
+  if (reg) {
+    if (post && want_value)
+      emit("  mov x0, %s\n", reg);
+    if (is_imm) {
+      gen_add_small(reg, reg, imm);
+    } else {
+      char *src = is_leaf(rhs) ? gen_leaf_operand("x1", rhs) : gen_operand(rhs);
+      gen_arith(op, ty, reg, reg, src, "x16");
+    }
+    if (size_of(ty) == 1)
+      emit("  sxtb %s, w%s\n", reg, reg + 1);
+    if (!post && want_value)
+      emit("  mov x0, %s\n", reg);
     return;
   }
+
+  // 複雑な右辺は左辺のアドレス計算より先に評価して退避しておく
+  bool spill = !is_imm && !is_leaf(rhs);
+  if (spill) {
+    gen(rhs);
+    gen_push("x0");
+  }
+
+  // アドレスはx1, x2 (またはx29や呼び出し先保存レジスタ) に置き、
+  // 右辺をx17、新しい値を後置ならx17、そうでなければx0に求める。
+  // 関数呼び出しの引数を並べている途中でも評価されるので、
+  // x3〜x7は使わない (has_callを参照)。アドレスがx16に入っていれば、
+  // ポインタの加減算の作業用にはx2を使う
+  Addr addr = gen_addr_mode(lhs, "x1");
+  keep_off_x0(&addr);
+  if (spill)
+    gen_pop("x17");
+  else if (!is_imm)
+    gen_leaf("x17", rhs);
+
+  char mem[256];
+  snprintf(mem, sizeof(mem), "%s", mem_operand(&addr, access_size(ty)));
+  char *dst = post ? "x17" : "x0";
+  load_to("x0", ty, mem);
+  if (is_imm)
+    gen_add_small(dst, "x0", imm);
+  else
+    gen_arith(op, ty, dst, "x0", "x17", strcmp(mem, "[x16]") ? "x16" : "x2");
+  store_reg(dst, ty, mem);
+}
+
+void gen(Node *node) {
+  switch (node->kind) {
+  case ND_NULL:
+    return;
+  case ND_NUM:
+    gen_imm("x0", node->val);
+    return;
+  case ND_EXPR_STMT:
+    // 式文は結果を使わないので、x0の値は捨ててよい
+    if (assign_op_kind(node->lhs->kind) != ND_NULL) {
+      gen_assign_op(node->lhs, false);
+      return;
+    }
+    gen(node->lhs);
+    return;
+  case ND_VAR:
+  case ND_DEREF:
+    if (var_reg(node)) {
+      emit("  mov x0, %s\n", var_reg(node));
+      return;
+    }
+    if (node->ty->kind == TY_ARRAY) {
+      // 配列は先頭要素へのポインタとして扱う
+      gen_addr(node);
+      return;
+    }
+    gen_load(node);
+    return;
+  case ND_ASSIGN:
+    gen_store(node->lhs, node->rhs);
+    return;
+  case ND_ADD_ASSIGN:
+  case ND_SUB_ASSIGN:
+  case ND_MUL_ASSIGN:
+  case ND_DIV_ASSIGN:
+  case ND_POST_INC:
+  case ND_POST_DEC:
+    gen_assign_op(node, true);
+    return;
+  case ND_FUN_CALL:
+    gen_funcall(node);
+    return;
   case ND_RETURN:
     gen(node->lhs);
-    gen_pop("x0");
-    printf("  b .L.return.%s\n", func_name);
+    emit("  b .L.return.%s\n", func_name);
     return;
   case ND_BLOCK:
   case ND_STMT_EXPR:
@@ -143,39 +1134,74 @@ void gen(Node *node) {
   case ND_ADDR:
     gen_addr(node->lhs);
     return;
-  case ND_DEREF:
-    gen(node->lhs);
-    if (node->ty->kind != TY_ARRAY) {
-      load(node->ty);
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+  case ND_GT:
+  case ND_GE:
+    gen_compare(node);
+    gen_cset(node->kind);
+    return;
+  case ND_NOT:
+    if (is_compare(node->lhs)) {
+      gen_compare(node->lhs);
+      emit("  cset x0, %s\n", cond_code(node->lhs->kind, true));
+      return;
+    }
+    emit("  cmp %s, #0\n", gen_operand(node->lhs));
+    emit("  cset x0, eq\n");
+    return;
+  case ND_COND: {
+    if (is_speculatable(node->then) && is_speculatable(node->els)) {
+      gen_select(node);
+      return;
     }
+
+    int seq = labelseq++;
+    char *label = format(".L.cond.false.%s.%d", func_name, seq);
+    gen_branch(node->cond, false, label);
+    gen(node->then);
+    emit("  b .L.cond.end.%s.%d\n", func_name, seq);
+    emit("%s:\n", label);
+    gen(node->els);
+    emit(".L.cond.end.%s.%d:\n", func_name, seq);
     return;
+  }
+  case ND_LOGAND:
+  case ND_LOGOR: {
+    // 分岐で真偽を判定し、0/1をx0に格納する
+    int seq = labelseq++;
+    char *label = format(".L.cond.false.%s.%d", func_name, seq);
+    gen_branch(node, false, label);
+    emit("  mov x0, #1\n");
+    emit("  b .L.cond.end.%s.%d\n", func_name, seq);
+    emit("%s:\n", label);
+    emit("  mov x0, #0\n");
+    emit(".L.cond.end.%s.%d:\n", func_name, seq);
+    return;
+  }
   case ND_IF: {
     int seq = labelseq++;
 
-    // 条件式
-    gen(node->cond);
-    gen_pop("x0");
-    printf("  cmp x0, #0\n"); // x0と0を比較
-
-    // 条件の結果が0(false)なら
-    if (node->els) {
-      printf("  b.eq .L.if.else.%d\n", seq); // else節へジャンプ
-    } else {
-      printf("  b.eq .L.if.end.%d\n", seq); // end節へジャンプ
-    }
+    // 条件が偽ならelse節、else節がなければend節へジャンプ
+    char *label = format(node->els ? ".L.if.else.%s.%d" : ".L.if.end.%s.%d",
+                         func_name, seq);
+    gen_branch(node->cond, false, label);
 
     // then節
     gen(node->then);
-    printf("  b .L.if.end.%d\n", seq); // end節へジャンプ
 
     if (node->els) {
+      emit("  b .L.if.end.%s.%d\n", func_name, seq); // end節へジャンプ
+
       // else節
-      printf(".L.if.else.%d:\n", seq);
+      emit(".L.if.else.%s.%d:\n", func_name, seq);
       gen(node->els);
     }
 
     // end節
-    printf(".L.if.end.%d:\n", seq);
+    emit(".L.if.end.%s.%d:\n", func_name, seq);
 
     return;
   }
@@ -183,24 +1209,23 @@ void gen(Node *node) {
     int seq = labelseq++;
 
     // 繰り返しの開始ラベル
-    printf(".L.while.begin.%d:\n", seq);
-
-    // 条件式
-    gen(node->cond);
-    gen_pop("x0");
-    printf("  cmp x0, #0\n"); // x0と0を比較
+    emit(".L.while.begin.%s.%d:\n", func_name, seq);
 
-    // 条件の結果が0(false)なら繰り返し終了
-    printf("  b.eq .L.while.end.%d\n", seq);
+    // 条件が偽なら繰り返し終了
+    char *label = format(".L.break.%s.%d", func_name, seq);
+    gen_branch(node->cond, false, label);
 
     // 繰り返し本体
+    int brk = brkseq;
+    brkseq = seq;
     gen(node->then);
+    brkseq = brk;
 
     // 繰り返しの先頭に戻る
-    printf("  b .L.while.begin.%d\n", seq);
+    emit("  b .L.while.begin.%s.%d\n", func_name, seq);
 
-    // 繰り返しの終了ラベル
-    printf(".L.while.end.%d:\n", seq);
+    // 繰り返しの終了ラベル (breakの飛び先)
+    emit(".L.break.%s.%d:\n", func_name, seq);
 
     return;
   }
@@ -212,159 +1237,404 @@ void gen(Node *node) {
       gen(node->init);
 
     // 繰り返しの開始ラベル
-    printf(".L.for.begin.%d:\n", seq);
+    emit(".L.for.begin.%s.%d:\n", func_name, seq);
 
     // 条件式
     if (node->cond) {
-      gen(node->cond);
-      gen_pop("x0");
-      printf("  cmp x0, #0\n"); // x0と0を比較
-
-      // 条件の結果が0(false)なら繰り返し終了
-      printf("  b.eq .L.for.end.%d\n", seq);
+      // 条件が偽なら繰り返し終了
+      char *label = format(".L.break.%s.%d", func_name, seq);
+      gen_branch(node->cond, false, label);
     }
 
     // 繰り返し本体
+    int brk = brkseq;
+    brkseq = seq;
     gen(node->then);
+    brkseq = brk;
 
     // 増分文
     if (node->inc)
       gen(node->inc);
 
     // 繰り返しの先頭に戻る
-    printf("  b .L.for.begin.%d\n", seq);
+    emit("  b .L.for.begin.%s.%d\n", func_name, seq);
 
-    // 繰り返しの終了ラベル
-    printf(".L.for.end.%d:\n", seq);
+    // 繰り返しの終了ラベル (breakの飛び先)
+    emit(".L.break.%s.%d:\n", func_name, seq);
 
     return;
   }
-  default:
-    break;
-  }
-
-  gen(node->lhs);
-  gen(node->rhs);
-  gen_pop("x1");
-  gen_pop("x0");
+  case ND_SWITCH: {
+    int seq = labelseq++;
+    gen(node->cond);
 
-  switch (node->kind) {
-  case ND_ADD:
-    if (node->ty->base) {
-      // ポインタ型の場合、スケーリングする
-      printf("  mov x2, #%d\n", size_of(node->ty->base));
-      printf("  mul x1, x1, x2\n");
+    // caseを値の昇順に並べ、それぞれにラベルを割り当てる
+    int ncases = 0;
+    for (Node *n = node->case_next; n; n = n->case_next)
+      ncases++;
+    Node **cases = calloc(ncases + 1, sizeof(Node *));
+    int i = 0;
+    for (Node *n = node->case_next; n; n = n->case_next) {
+      n->case_label = labelseq++;
+      cases[i++] = n;
     }
-    printf("  add x0, x0, x1\n");
-    break;
-  case ND_SUB:
-    if (node->ty->base) {
-      // ポインタ型の場合、スケーリングする
-      printf("  mov x2, #%d\n", size_of(node->ty->base));
-      printf("  mul x1, x1, x2\n");
+    qsort(cases, ncases, sizeof(Node *), compare_case);
+    for (i = 1; i < ncases; i++)
+      if (cases[i - 1]->val == cases[i]->val)
+        error_tok(cases[i]->tok, "caseの値が重複しています");
+
+    // どのcaseにも一致しなければdefault節、なければswitch文の後ろに飛ぶ
+    char *dflt;
+    if (node->default_case) {
+      node->default_case->case_label = labelseq++;
+      dflt = format(".L.case.%s.%d", func_name, node->default_case->case_label);
+    } else {
+      dflt = format(".L.break.%s.%d", func_name, seq);
     }
-    printf("  sub x0, x0, x1\n");
-    break;
-  case ND_MUL:
-    printf("  mul x0, x0, x1\n");
-    break;
-  case ND_DIV:
-    printf("  sdiv x0, x0, x1\n");
-    break;
-  case ND_EQ:
-    printf("  cmp x0, x1\n");
-    printf("  cset x0, eq\n");
-    break;
-  case ND_NE:
-    printf("  cmp x0, x1\n");
-    printf("  cset x0, ne\n");
-    break;
-  case ND_LT:
-    printf("  cmp x0, x1\n");
-    printf("  cset x0, lt\n");
-    break;
-  case ND_LE:
-    printf("  cmp x0, x1\n");
-    printf("  cset x0, le\n");
-    break;
-  case ND_GT:
-    printf("  cmp x0, x1\n");
-    printf("  cset x0, gt\n");
-    break;
-  case ND_GE:
-    printf("  cmp x0, x1\n");
-    printf("  cset x0, ge\n");
-    break;
+
+    // caseの値が密集していれば表引き、疎なら比較で分岐する
+    if (is_dense_cases(cases, ncases))
+      gen_jump_table(cases, ncases, dflt);
+    else
+      gen_case_search(cases, 0, ncases - 1, dflt);
+
+    int brk = brkseq;
+    brkseq = seq;
+    gen(node->then);
+    brkseq = brk;
+
+    emit(".L.break.%s.%d:\n", func_name, seq);
+    return;
+  }
+  case ND_CASE:
+    emit(".L.case.%s.%d:\n", func_name, node->case_label);
+    gen(node->lhs);
+    return;
+  case ND_BREAK:
+    if (brkseq < 0)
+      error_tok(node->tok, "ループやswitch文の外でbreakが使われています");
+    emit("  b .L.break.%s.%d\n", func_name, brkseq);
+    return;
   default:
     break;
   }
 
-  gen_push("x0");
+  // 右辺が小さな定数なら、即値オペランドとして命令に埋め込む
+  if (gen_binary_imm(node))
+    return;
+
+  char *lhs, *rhs;
+  gen_operands(node, &lhs, &rhs);
+  gen_arith(node->kind, node->ty, "x0", lhs, rhs, "x16");
 }
 
-// dataセクションを出力する
+// データのセクションを出力する
 void emit_data(Program *prog) {
-  printf(".data\n");
+  // グローバル変数は0で初期化されるので、ファイルに中身を持たないbssに置く
+  emit(".bss\n");
   for (VarList *vl = prog->global_vars; vl; vl = vl->next) {
     Var *var = vl->var;
-    printf(".globl .L.%s\n", var->name);
-    printf(".L.%s:\n", var->name);
-    if (var->contents) {
-      // 文字列リテラル
-      for (int i = 0; i < var->contents_len; i++)
-        printf("  .byte %d\n", var->contents[i]);
-    } else {
-      // グローバル変数
-      printf("  .zero %d\n", size_of(var->ty));
-    }
+    if (var->contents)
+      continue;
+    // :lo12: を埋め込んだ8バイトロード/ストアのため8バイト境界に揃える
+    emit(".p2align 3\n");
+    emit(".globl .L.%s\n", var->name);
+    emit(".L.%s:\n", var->name);
+    emit("  .zero %d\n", size_of(var->ty));
+  }
+
+  // 文字列リテラルは書き換えないのでrodataに置く
+  emit(".section .rodata\n");
+  for (VarList *vl = prog->global_vars; vl; vl = vl->next) {
+    Var *var = vl->var;
+    if (!var->contents)
+      continue;
+    emit(".globl .L.%s\n", var->name);
+    emit(".L.%s:\n", var->name);
+    for (int i = 0; i < var->contents_len; i++)
+      emit("  .byte %d\n", var->contents[i]);
+  }
+  flush_insns(insns);
+}
+
+// 関数内の変数の参照を数える
+VarRef *find_var_ref(Var *var) {
+  for (VarRef *ref = var_refs; ref; ref = ref->next)
+    if (ref->var == var)
+      return ref;
+
+  VarRef *ref = calloc(1, sizeof(VarRef));
+  ref->var = var;
+  ref->next = var_refs;
+  var_refs = ref;
+  return ref;
+}
+
+void count_var_refs(Node *node, int weight) {
+  if (!node)
+    return;
+
+  if (node->kind == ND_VAR)
+    find_var_ref(node->var)->weight += weight;
+  if (node->kind == ND_ADDR && node->lhs->kind == ND_VAR)
+    find_var_ref(node->lhs->var)->addr_taken = true;
+
+  // ループの条件・本体・増分は繰り返し実行されるので重く数える
+  bool is_loop = node->kind == ND_WHILE || node->kind == ND_FOR;
+  int inner = weight;
+  if (is_loop && inner < 1000000)
+    inner *= 10;
+
+  Node **slots[MAX_CHILDREN];
+  int nslots = child_slots(node, slots);
+  for (int i = 0; i < nslots; i++) {
+    int w = is_loop && slots[i] != &node->init ? inner : weight;
+    for (Node *n = *slots[i]; n; n = n->next)
+      count_var_refs(n, w);
+  }
+}
+
+// 2回以上使われる変数に、重みの大きい順で呼び出し先保存レジスタを割り当てる
+void assign_regs(Function *fn) {
+  var_refs = NULL;
+  num_saved_regs = 0;
+  for (VarList *vl = fn->local_vars; vl; vl = vl->next)
+    vl->var->reg = NULL;
+
+  for (VarList *vl = fn->params; vl; vl = vl->next)
+    find_var_ref(vl->var);
+  for (Node *n = fn->node; n; n = n->next)
+    count_var_refs(n, 1);
+
+  // 配列と、アドレスを取られた変数はメモリに置く。
+  // アドレスから隣の変数を辿られることがあるので、同じスコープの変数も同様
+  for (VarRef *ref = var_refs; ref; ref = ref->next) {
+    if (!ref->var->is_local)
+      continue;
+    if (ref->var->ty->kind == TY_ARRAY)
+      ref->in_memory = true;
+    if (!ref->addr_taken)
+      continue;
+    for (VarRef *r = var_refs; r; r = r->next)
+      if (r->var->is_local && r->var->scope == ref->var->scope)
+        r->in_memory = true;
+  }
+
+  int max_regs = sizeof(callee_saved_regs) / sizeof(*callee_saved_regs);
+  while (num_saved_regs < max_regs) {
+    VarRef *best = NULL;
+    for (VarRef *ref = var_refs; ref; ref = ref->next)
+      if (!ref->reg && !ref->in_memory && ref->weight >= 2 &&
+          (!best || ref->weight > best->weight))
+        best = ref;
+    if (!best)
+      break;
+    best->reg = callee_saved_regs[num_saved_regs++];
+    if (best->var->is_local)
+      best->var->reg = best->reg;
+  }
+}
+
+// メモリに置くローカル変数のオフセットを決定する
+void assign_lvar_offsets(Function *fn) {
+  int offset = 0;
+  for (VarList *var_list = fn->local_vars; var_list;
+       var_list = var_list->next) {
+    Var *var = var_list->var;
+    if (var->reg)
+      continue;
+    offset += size_of(var->ty);
+    var->offset = offset;
+  }
+  fn->local_var_stack_size = align_to(offset, 16);
+}
+
+// 使用する呼び出し先保存レジスタをスタックに退避する
+void save_callee_regs() {
+  for (int i = 0; i < num_saved_regs; i += 2) {
+    if (i + 1 < num_saved_regs)
+      emit("  stp %s, %s, [sp, -16]!\n", callee_saved_regs[i],
+           callee_saved_regs[i + 1]);
+    else
+      gen_push(callee_saved_regs[i]);
+  }
+}
+
+// 退避した呼び出し先保存レジスタを逆順に復元する
+void restore_callee_regs() {
+  for (int i = (num_saved_regs - 1) & ~1; i >= 0; i -= 2) {
+    if (i + 1 < num_saved_regs)
+      emit("  ldp %s, %s, [sp], #16\n", callee_saved_regs[i],
+           callee_saved_regs[i + 1]);
+    else
+      gen_pop(callee_saved_regs[i]);
   }
 }
 
 // 引数をスタックに保存する
 void load_arg(Var *var, int idx) {
-  int sz = size_of(var->ty);
-  if (sz == 1)
-    printf("  strb %s, [x29, #-%d]\n", argreg1[idx], var->offset);
+  if (idx >= 8) {
+    // 9個目以降の引数は呼び出し元のスタックにある。
+    // 退避したレジスタとx29, x30の上が呼び出し時のspになる
+    int saved = align_to(num_saved_regs * 8, 16) + 16;
+    char mem[32];
+    snprintf(mem, sizeof(mem), "[x29, #%d]", saved + (idx - 8) * 8);
+    if (var->reg) {
+      load_to(var->reg, var->ty, mem);
+      return;
+    }
+    load_to("x0", var->ty, mem);
+    Addr addr = var_addr(var, "x16");
+    store_to(var->ty, mem_operand(&addr, access_size(var->ty)));
+    return;
+  }
+
+  if (var->reg) {
+    move_to_var(var->reg, var->ty, argreg8[idx]);
+    return;
+  }
+
+  Addr addr = var_addr(var, "x16");
+  char *mem = mem_operand(&addr, access_size(var->ty));
+  if (size_of(var->ty) == 1)
+    emit("  strb %s, %s\n", argreg1[idx], mem);
   else
-    printf("  str %s, [x29, #-%d]\n", argreg8[idx], var->offset);
+    emit("  str %s, %s\n", argreg8[idx], mem);
+}
+
+// 関数1つ分のコードを生成し、スケジューリングした行のリストを返す
+Insn *gen_function(Function *fn) {
+  if (fn->cached)
+    return fn->cached;
+
+  func_name = fn->name;
+  labelseq = 0;
+  brkseq = -1;
+
+  emit(".globl %s\n", fn->name);
+  emit("%s:\n", fn->name);
+  assign_regs(fn);
+  assign_lvar_offsets(fn);
+
+  // Prologue
+  save_callee_regs();
+  emit("  stp x29, x30, [sp, -16]!\n");
+  emit("  mov x29, sp\n");
+  if (fn->local_var_stack_size)
+    gen_add_imm("sp", "sp", -fn->local_var_stack_size);
+
+  // よく使うグローバル変数のアドレスを一度だけ計算しておく
+  for (VarRef *ref = var_refs; ref; ref = ref->next) {
+    if (!ref->reg || ref->var->is_local)
+      continue;
+    emit("  adrp %s, .L.%s\n", ref->reg, ref->var->name);
+    emit("  add %s, %s, :lo12:.L.%s\n", ref->reg, ref->reg, ref->var->name);
+  }
+
+  // 引数をスタックまたは割り当てたレジスタに保存
+  int i = 0;
+  for (VarList *var_list = fn->params; var_list; var_list = var_list->next) {
+    // 引数はすでにレジスタに入っているので、それをスタックに保存する
+    Var *var = var_list->var;
+    load_arg(var, i++);
+  }
+
+  // 各stmtのコードを生成
+  for (Node *n = fn->node; n; n = n->next) {
+    gen(n);
+  }
+
+  // Epilogue
+  emit(".L.return.%s:\n", func_name);
+  emit("  mov sp, x29\n");
+  emit("  ldp x29, x30, [sp], #16\n");
+  restore_callee_regs();
+  emit("  ret\n");
+
+  // 基本ブロックごとに命令を並べ替える
+  Insn *list = schedule(insns);
+  insns = insns_tail = NULL;
+  store_cache(fn, list);
+  return list;
+}
+
+// 並列コード生成で、スレッドが共有する仕事の表
+typedef struct {
+  Function **fns;   // コードを生成する関数 (ソース順)
+  Insn **results;   // 関数ごとに生成した行のリスト
+  int nfns;         // 関数の数
+  int next;         // 次に取り出す関数の番号
+  char *filename;   // 入力ファイル名 (エラーの報告に使う)
+  char *user_input; // 入力プログラム (同上)
+  pthread_mutex_t mutex;
+} CodegenQueue;
+
+// 表から関数を1つずつ取り出してコードを生成する。
+// 入力はスレッドごとに持つので、エラーを報告できるように受け取っておく
+void *codegen_worker(void *arg) {
+  CodegenQueue *q = arg;
+  filename = q->filename;
+  user_input = q->user_input;
+  for (;;) {
+    pthread_mutex_lock(&q->mutex);
+    int i = q->next++;
+    pthread_mutex_unlock(&q->mutex);
+    if (i >= q->nfns)
+      return NULL;
+    q->results[i] = gen_function(q->fns[i]);
+  }
 }
 
 // textセクションを出力する
+// 関数ごとのコードはスレッドプールで並列に生成し、ソース順につなげて出力する
 void emit_text(Program *prog) {
-  printf("  .text\n");
+  emit("  .text\n");
+  flush_insns(insns);
 
-  for (Function *fn = prog->fns; fn; fn = fn->next) {
-    printf(".globl %s\n", fn->name);
-    printf("%s:\n", fn->name);
-    func_name = fn->name;
+  CodegenQueue q = {0};
+  for (Function *fn = prog->fns; fn; fn = fn->next)
+    q.nfns++;
+  q.fns = calloc(q.nfns, sizeof(Function *));
+  q.results = calloc(q.nfns, sizeof(Insn *));
+  int n = 0;
+  for (Function *fn = prog->fns; fn; fn = fn->next)
+    q.fns[n++] = fn;
+  q.filename = filename;
+  q.user_input = user_input;
+  pthread_mutex_init(&q.mutex, NULL);
 
-    // Prologue
-    printf("  stp x29, x30, [sp, -16]!\n");
-    printf("  mov x29, sp\n");
-    printf("  sub sp, sp, #%d\n", fn->local_var_stack_size);
+  int nthreads = codegen_threads;
+  if (nthreads <= 0)
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > q.nfns)
+    nthreads = q.nfns;
 
-    // 引数をスタックに保存
-    int i = 0;
-    for (VarList *var_list = fn->params; var_list; var_list = var_list->next) {
-      // 引数はすでにレジスタに入っているので、それをスタックに保存する
-      Var *var = var_list->var;
-      load_arg(var, i++);
-    }
+  // 呼び出したスレッドも1つのワーカーとして働く
+  pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+  for (int i = 1; i < nthreads; i++)
+    create_thread(&threads[i], codegen_worker, &q);
+  codegen_worker(&q);
+  for (int i = 1; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+  pthread_mutex_destroy(&q.mutex);
 
-    // 各stmtのコードを生成
-    for (Node *n = fn->node; n; n = n->next) {
-      gen(n);
-    }
+  for (int i = 0; i < q.nfns; i++)
+    flush_insns(q.results[i]);
+}
 
-    // Epilogue
-    printf(".L.return.%s:\n", func_name);
-    printf("  mov sp, x29\n");
-    printf("  ldp x29, x30, [sp], #16\n");
-    printf("  ret\n");
-  }
+void codegen_arm64(Program *prog) {
+  emit_data(prog);
+  emit_text(prog);
 }
 
-void codegen(Program *prog) {
+// ARM64のアセンブリを生成して、行のリストとして返す
+Insn *emit_arm64(Program *prog) {
+  Insn head = {0};
+  output_tail = &head;
   emit_data(prog);
   emit_text(prog);
+  output_tail = NULL;
+  return head.next;
 }
+
+Target target_arm64 = {"arm64", codegen_arm64, emit_arm64};
@@ -0,0 +1,640 @@
+#include "he3cc.h"
+
+// x86-64 (System V ABI) 向けのコード生成
+//
+// 式の値は%raxに置き、二項演算の左辺はスタックに退避する。
+// ARM64版と同じ構文木から、同じ意味のコードを生成する。出力はARM64版と
+// 共通のemit()で行のリストにためるので、--runではそれを機械語に変換する。
+// ARM64版 (codegen.c) と名前が重ならないよう、このファイルの関数と変数には
+// x86_を付ける
+
+// 制御構文でジャンプするためのラベルの通し番号
+_Thread_local int x86_labelseq;
+
+// breakで抜ける先の.L.breakラベルの番号 (ループやswitch文の外では-1)
+_Thread_local int x86_brkseq = -1;
+
+// スタックに積んでいる8バイト値の数 (関数呼び出し時のアラインメント用)
+_Thread_local int x86_depth;
+
+// 現在コード生成中の関数名
+_Thread_local char *x86_func_name;
+
+// 引数を格納するレジスタの名前
+char *x86_argreg8[] = {"%dil", "%sil", "%dl", "%cl", "%r8b", "%r9b"};
+char *x86_argreg64[] = {"%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"};
+
+void x86_gen(Node *node);
+
+void x86_push(void) {
+  emit("  push %%rax\n");
+  x86_depth++;
+}
+
+void x86_pop(char *reg) {
+  emit("  pop %s\n", reg);
+  x86_depth--;
+}
+
+// 比較演算kindに対応する条件コードを返す。negateなら否定した条件を返す
+char *x86_cond_code(NodeKind kind, bool negate) {
+  switch (kind) {
+  case ND_EQ:
+    return negate ? "ne" : "e";
+  case ND_NE:
+    return negate ? "e" : "ne";
+  case ND_LT:
+    return negate ? "ge" : "l";
+  case ND_LE:
+    return negate ? "g" : "le";
+  case ND_GT:
+    return negate ? "le" : "g";
+  case ND_GE:
+    return negate ? "l" : "ge";
+  default:
+    error("不正な比較演算です");
+    return NULL;
+  }
+}
+
+bool x86_is_compare(Node *node) {
+  switch (node->kind) {
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+  case ND_GT:
+  case ND_GE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// 32bit符号付き即値に収まる整数定数かどうか
+bool x86_is_imm32(Node *node, long scale) {
+  if (node->kind != ND_NUM)
+    return false;
+  long val = node->val * scale;
+  return -2147483648L <= val && val <= 2147483647L;
+}
+
+// 左辺値nodeのアドレスを%raxに格納する
+void x86_gen_addr(Node *node) {
+  switch (node->kind) {
+  case ND_VAR:
+    if (node->var->is_local)
+      emit("  lea -%d(%%rbp), %%rax\n", node->var->offset);
+    else
+      emit("  lea .L.%s(%%rip), %%rax\n", node->var->name);
+    return;
+  case ND_DEREF:
+    x86_gen(node->lhs);
+    return;
+  default:
+    error_tok(node->tok, "代入の左辺値が変数ではありません");
+  }
+}
+
+// 代入の左辺値として使えるか確認する
+void x86_check_lval(Node *node) {
+  if (node->ty->kind == TY_ARRAY)
+    error_tok(node->tok, "配列は代入の左辺値になれません");
+}
+
+// %raxが指すアドレスから値をロードして%raxに格納する
+void x86_load(Type *ty) {
+  // 配列は先頭要素へのポインタのまま使う
+  if (ty->kind == TY_ARRAY)
+    return;
+  if (size_of(ty) == 1)
+    emit("  movsbq (%%rax), %%rax\n"); // 1バイトを符号拡張
+  else
+    emit("  mov (%%rax), %%rax\n"); // 8バイト
+}
+
+// %raxの値を、スタックから取り出したアドレスにストアする。値は%raxに残る
+void x86_store(Type *ty) {
+  x86_pop("%rdi");
+  if (size_of(ty) == 1)
+    emit("  mov %%al, (%%rdi)\n");
+  else
+    emit("  mov %%rax, (%%rdi)\n");
+}
+
+// 算術演算 %rax = %rax op %rdi を生成する (opはND_ADD, ND_SUB, ND_MUL,
+// ND_DIV)。ポインタの加減算は%rdiを要素サイズ倍する
+void x86_gen_arith(NodeKind op, Type *ty) {
+  switch (op) {
+  case ND_ADD:
+  case ND_SUB:
+    if (ty->base)
+      emit("  imul $%d, %%rdi\n", size_of(ty->base));
+    emit("  %s %%rdi, %%rax\n", op == ND_ADD ? "add" : "sub");
+    return;
+  case ND_MUL:
+    emit("  imul %%rdi, %%rax\n");
+    return;
+  case ND_DIV:
+    emit("  cqo\n");
+    emit("  idiv %%rdi\n");
+    return;
+  default:
+    return;
+  }
+}
+
+// 二項演算nodeの左辺を%rax、右辺を%rdiに評価する
+void x86_gen_operands(Node *node) {
+  x86_gen(node->lhs);
+  x86_push();
+  x86_gen(node->rhs);
+  emit("  mov %%rax, %%rdi\n");
+  x86_pop("%rax");
+}
+
+// 条件式nodeを評価して結果をフラグに残し、真を表す条件コードを返す
+char *x86_gen_cond_flags(Node *node) {
+  if (x86_is_compare(node)) {
+    if (x86_is_imm32(node->rhs, 1)) {
+      x86_gen(node->lhs);
+      emit("  cmp $%d, %%rax\n", node->rhs->val);
+    } else {
+      x86_gen_operands(node);
+      emit("  cmp %%rdi, %%rax\n");
+    }
+    return x86_cond_code(node->kind, false);
+  }
+  x86_gen(node);
+  emit("  test %%rax, %%rax\n");
+  return "ne";
+}
+
+// 条件式nodeの真偽がwhenに一致すればlabelに分岐し、そうでなければ
+// 次の命令に進むコードを生成する。&&と||は短絡評価する
+void x86_gen_branch(Node *node, bool when, char *label) {
+  switch (node->kind) {
+  case ND_LOGAND:
+  case ND_LOGOR: {
+    bool is_and = node->kind == ND_LOGAND;
+    if (when != is_and) {
+      x86_gen_branch(node->lhs, when, label);
+      x86_gen_branch(node->rhs, when, label);
+      return;
+    }
+    char skip[32];
+    snprintf(skip, sizeof(skip), ".L.cond.skip.%d", x86_labelseq++);
+    x86_gen_branch(node->lhs, !when, skip);
+    x86_gen_branch(node->rhs, when, label);
+    emit("%s:\n", skip);
+    return;
+  }
+  case ND_NOT:
+    x86_gen_branch(node->lhs, !when, label);
+    return;
+  default:
+    break;
+  }
+
+  if (x86_is_compare(node)) {
+    x86_gen_cond_flags(node);
+    emit("  j%s %s\n", x86_cond_code(node->kind, !when), label);
+    return;
+  }
+
+  x86_gen(node);
+  emit("  test %%rax, %%rax\n");
+  emit("  j%s %s\n", when ? "ne" : "e", label);
+}
+
+// 関数呼び出しを生成する。戻り値は%raxに入る。
+// 引数は右から順にスタックに積み、先頭の6個をレジスタに取り出す。
+// 残りはそのままスタック渡しの引数になる
+void x86_gen_funcall(Node *node) {
+  int nargs = 0;
+  for (Node *arg = node->args; arg; arg = arg->next)
+    nargs++;
+  Node **args = calloc(nargs + 1, sizeof(Node *));
+  int i = 0;
+  for (Node *arg = node->args; arg; arg = arg->next)
+    args[i++] = arg;
+
+  // call命令の時点で%rspを16バイト境界に揃える
+  int nstack = nargs > 6 ? nargs - 6 : 0;
+  bool pad = (x86_depth + nstack) % 2;
+  if (pad) {
+    emit("  sub $8, %%rsp\n");
+    x86_depth++;
+  }
+
+  for (i = nargs - 1; i >= 0; i--) {
+    x86_gen(args[i]);
+    x86_push();
+  }
+  for (i = 0; i < nargs && i < 6; i++)
+    x86_pop(x86_argreg64[i]);
+
+  // 可変長引数の関数のため、ベクタレジスタで渡す引数の数を0にする
+  emit("  mov $0, %%eax\n");
+  emit("  call %s\n", node->func_name);
+
+  int cleanup = nstack + (pad ? 1 : 0);
+  if (cleanup) {
+    emit("  add $%d, %%rsp\n", cleanup * 8);
+    x86_depth -= cleanup;
+  }
+}
+
+// 複合代入・インクリメント/デクリメントの演算の種類
+NodeKind x86_assign_op_kind(NodeKind kind) {
+  switch (kind) {
+  case ND_ADD_ASSIGN:
+  case ND_POST_INC:
+    return ND_ADD;
+  case ND_SUB_ASSIGN:
+  case ND_POST_DEC:
+    return ND_SUB;
+  case ND_MUL_ASSIGN:
+    return ND_MUL;
+  case ND_DIV_ASSIGN:
+    return ND_DIV;
+  default:
+    return ND_NULL;
+  }
+}
+
+// 複合代入 lhs op= rhs と後置インクリメント/デクリメントを生成する。
+// 左辺のアドレスは一度だけ計算する。後置なら更新前の値を%raxに残す
+void x86_gen_assign_op(Node *node) {
+  x86_check_lval(node->lhs);
+  x86_gen_addr(node->lhs);
+  x86_push();
+  x86_gen(node->rhs);
+  emit("  mov %%rax, %%rdi\n");
+  emit("  mov (%%rsp), %%rax\n");
+  x86_load(node->lhs->ty);
+  emit("  mov %%rax, %%rsi\n");
+  x86_gen_arith(x86_assign_op_kind(node->kind), node->lhs->ty);
+  x86_store(node->lhs->ty);
+  if (node->kind == ND_POST_INC || node->kind == ND_POST_DEC)
+    emit("  mov %%rsi, %%rax\n");
+}
+
+// switch文のジャンプテーブル。テーブルには表の先頭からcaseのラベルまでの
+// 距離を4バイトで並べる
+void x86_gen_jump_table(Node **cases, int ncases, char *dflt) {
+  int seq = x86_labelseq++;
+  long min = cases[0]->val;
+  long max = cases[ncases - 1]->val;
+
+  // %rax - min を符号なしで比較すれば、範囲の上下を一度に判定できる
+  emit("  sub $%ld, %%rax\n", min);
+  emit("  cmp $%ld, %%rax\n", max - min);
+  emit("  ja %s\n", dflt);
+  emit("  lea .L.jump.%d(%%rip), %%rdx\n", seq);
+  emit("  movslq (%%rdx,%%rax,4), %%rax\n");
+  emit("  add %%rdx, %%rax\n");
+  emit("  jmp *%%rax\n");
+
+  emit(".L.jump.%d:\n", seq);
+  int i = 0;
+  for (long v = min; v <= max; v++) {
+    if (cases[i]->val == v)
+      emit("  .long .L.case.%d - .L.jump.%d\n", cases[i++]->case_label, seq);
+    else
+      emit("  .long %s - .L.jump.%d\n", dflt, seq);
+  }
+}
+
+// %raxの値とcases[lo..hi]を比較して、一致するcaseに分岐する。
+// 数が少なければ順に比較し、多ければ中央の値で二分探索する
+void x86_gen_case_search(Node **cases, int lo, int hi, char *dflt) {
+  if (hi - lo < 4) {
+    for (int i = lo; i <= hi; i++) {
+      emit("  cmp $%d, %%rax\n", cases[i]->val);
+      emit("  je .L.case.%d\n", cases[i]->case_label);
+    }
+    emit("  jmp %s\n", dflt);
+    return;
+  }
+
+  int mid = (lo + hi) / 2;
+  int seq = x86_labelseq++;
+  emit("  cmp $%d, %%rax\n", cases[mid]->val);
+  emit("  je .L.case.%d\n", cases[mid]->case_label);
+  emit("  jg .L.case.upper.%d\n", seq);
+  x86_gen_case_search(cases, lo, mid - 1, dflt);
+  emit(".L.case.upper.%d:\n", seq);
+  x86_gen_case_search(cases, mid + 1, hi, dflt);
+}
+
+void x86_gen_switch(Node *node) {
+  int seq = x86_labelseq++;
+  x86_gen(node->cond);
+
+  // caseを値の昇順に並べ、それぞれにラベルを割り当てる
+  int ncases = 0;
+  for (Node *n = node->case_next; n; n = n->case_next)
+    ncases++;
+  Node **cases = calloc(ncases + 1, sizeof(Node *));
+  int i = 0;
+  for (Node *n = node->case_next; n; n = n->case_next) {
+    n->case_label = x86_labelseq++;
+    cases[i++] = n;
+  }
+  qsort(cases, ncases, sizeof(Node *), compare_case);
+  for (i = 1; i < ncases; i++)
+    if (cases[i - 1]->val == cases[i]->val)
+      error_tok(cases[i]->tok, "caseの値が重複しています");
+
+  // どのcaseにも一致しなければdefault節、なければswitch文の後ろに飛ぶ
+  char dflt[32];
+  if (node->default_case) {
+    node->default_case->case_label = x86_labelseq++;
+    snprintf(dflt, sizeof(dflt), ".L.case.%d", node->default_case->case_label);
+  } else {
+    snprintf(dflt, sizeof(dflt), ".L.break.%d", seq);
+  }
+
+  if (is_dense_cases(cases, ncases))
+    x86_gen_jump_table(cases, ncases, dflt);
+  else
+    x86_gen_case_search(cases, 0, ncases - 1, dflt);
+
+  int brk = x86_brkseq;
+  x86_brkseq = seq;
+  x86_gen(node->then);
+  x86_brkseq = brk;
+
+  emit(".L.break.%d:\n", seq);
+}
+
+void x86_gen(Node *node) {
+  switch (node->kind) {
+  case ND_NULL:
+    return;
+  case ND_NUM:
+    emit("  mov $%d, %%rax\n", node->val);
+    return;
+  case ND_EXPR_STMT:
+    x86_gen(node->lhs);
+    return;
+  case ND_VAR:
+  case ND_DEREF:
+    x86_gen_addr(node);
+    x86_load(node->ty);
+    return;
+  case ND_ADDR:
+    x86_gen_addr(node->lhs);
+    return;
+  case ND_ASSIGN:
+    x86_check_lval(node->lhs);
+    x86_gen_addr(node->lhs);
+    x86_push();
+    x86_gen(node->rhs);
+    x86_store(node->lhs->ty);
+    return;
+  case ND_ADD_ASSIGN:
+  case ND_SUB_ASSIGN:
+  case ND_MUL_ASSIGN:
+  case ND_DIV_ASSIGN:
+  case ND_POST_INC:
+  case ND_POST_DEC:
+    x86_gen_assign_op(node);
+    return;
+  case ND_FUN_CALL:
+    x86_gen_funcall(node);
+    return;
+  case ND_RETURN:
+    x86_gen(node->lhs);
+    emit("  jmp .L.return.%s\n", x86_func_name);
+    return;
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    for (Node *n = node->body; n; n = n->next)
+      x86_gen(n);
+    return;
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+  case ND_GT:
+  case ND_GE: {
+    char *cc = x86_gen_cond_flags(node);
+    emit("  set%s %%al\n", cc);
+    emit("  movzbq %%al, %%rax\n");
+    return;
+  }
+  case ND_NOT:
+    x86_gen(node->lhs);
+    emit("  test %%rax, %%rax\n");
+    emit("  sete %%al\n");
+    emit("  movzbq %%al, %%rax\n");
+    return;
+  case ND_LOGAND:
+  case ND_LOGOR: {
+    int seq = x86_labelseq++;
+    char label[32];
+    snprintf(label, sizeof(label), ".L.cond.false.%d", seq);
+    x86_gen_branch(node, false, label);
+    emit("  mov $1, %%rax\n");
+    emit("  jmp .L.cond.end.%d\n", seq);
+    emit("%s:\n", label);
+    emit("  mov $0, %%rax\n");
+    emit(".L.cond.end.%d:\n", seq);
+    return;
+  }
+  case ND_COND: {
+    // 両辺が先行評価できるならcmovで選ぶ
+    if (is_speculatable(node->then) && is_speculatable(node->els)) {
+      x86_gen(node->then);
+      x86_push();
+      x86_gen(node->els);
+      x86_push();
+      char *cc = x86_gen_cond_flags(node->cond);
+      x86_pop("%rdx");
+      x86_pop("%rcx");
+      emit("  mov %%rdx, %%rax\n");
+      emit("  cmov%s %%rcx, %%rax\n", cc);
+      return;
+    }
+
+    int seq = x86_labelseq++;
+    char label[32];
+    snprintf(label, sizeof(label), ".L.cond.false.%d", seq);
+    x86_gen_branch(node->cond, false, label);
+    x86_gen(node->then);
+    emit("  jmp .L.cond.end.%d\n", seq);
+    emit("%s:\n", label);
+    x86_gen(node->els);
+    emit(".L.cond.end.%d:\n", seq);
+    return;
+  }
+  case ND_IF: {
+    int seq = x86_labelseq++;
+    char label[32];
+    snprintf(label, sizeof(label), node->els ? ".L.if.else.%d" : ".L.if.end.%d",
+             seq);
+    x86_gen_branch(node->cond, false, label);
+    x86_gen(node->then);
+    if (node->els) {
+      emit("  jmp .L.if.end.%d\n", seq);
+      emit(".L.if.else.%d:\n", seq);
+      x86_gen(node->els);
+    }
+    emit(".L.if.end.%d:\n", seq);
+    return;
+  }
+  case ND_WHILE: {
+    int seq = x86_labelseq++;
+    char label[32];
+    snprintf(label, sizeof(label), ".L.break.%d", seq);
+    emit(".L.while.begin.%d:\n", seq);
+    x86_gen_branch(node->cond, false, label);
+
+    int brk = x86_brkseq;
+    x86_brkseq = seq;
+    x86_gen(node->then);
+    x86_brkseq = brk;
+
+    emit("  jmp .L.while.begin.%d\n", seq);
+    emit("%s:\n", label);
+    return;
+  }
+  case ND_FOR: {
+    int seq = x86_labelseq++;
+    char label[32];
+    snprintf(label, sizeof(label), ".L.break.%d", seq);
+    if (node->init)
+      x86_gen(node->init);
+    emit(".L.for.begin.%d:\n", seq);
+    if (node->cond)
+      x86_gen_branch(node->cond, false, label);
+
+    int brk = x86_brkseq;
+    x86_brkseq = seq;
+    x86_gen(node->then);
+    x86_brkseq = brk;
+
+    if (node->inc)
+      x86_gen(node->inc);
+    emit("  jmp .L.for.begin.%d\n", seq);
+    emit("%s:\n", label);
+    return;
+  }
+  case ND_SWITCH:
+    x86_gen_switch(node);
+    return;
+  case ND_CASE:
+    emit(".L.case.%d:\n", node->case_label);
+    x86_gen(node->lhs);
+    return;
+  case ND_BREAK:
+    if (x86_brkseq < 0)
+      error_tok(node->tok, "ループやswitch文の外でbreakが使われています");
+    emit("  jmp .L.break.%d\n", x86_brkseq);
+    return;
+  default:
+    break;
+  }
+
+  // 右辺が定数の加減算は即値で計算する
+  if ((node->kind == ND_ADD || node->kind == ND_SUB) &&
+      x86_is_imm32(node->rhs, node->ty->base ? size_of(node->ty->base) : 1)) {
+    long val = node->rhs->val;
+    if (node->ty->base)
+      val *= size_of(node->ty->base);
+    x86_gen(node->lhs);
+    emit("  %s $%ld, %%rax\n", node->kind == ND_ADD ? "add" : "sub", val);
+    return;
+  }
+
+  x86_gen_operands(node);
+  x86_gen_arith(node->kind, node->ty);
+}
+
+// dataセクションを出力する
+void x86_emit_data(Program *prog) {
+  emit(".data\n");
+  for (VarList *vl = prog->global_vars; vl; vl = vl->next) {
+    Var *var = vl->var;
+    if (!var->contents)
+      emit(".p2align 3\n");
+    emit(".L.%s:\n", var->name);
+    if (var->contents) {
+      // 文字列リテラル
+      for (int i = 0; i < var->contents_len; i++)
+        emit("  .byte %d\n", var->contents[i]);
+    } else {
+      // グローバル変数
+      emit("  .zero %d\n", size_of(var->ty));
+    }
+  }
+}
+
+// ローカル変数のオフセットを決定する
+void x86_assign_lvar_offsets(Function *fn) {
+  int offset = 0;
+  for (VarList *vl = fn->local_vars; vl; vl = vl->next) {
+    Var *var = vl->var;
+    offset += size_of(var->ty);
+    var->offset = offset;
+  }
+  fn->local_var_stack_size = align_to(offset, 16);
+}
+
+// textセクションを出力する
+void x86_emit_text(Program *prog) {
+  emit("  .text\n");
+
+  for (Function *fn = prog->fns; fn; fn = fn->next) {
+    emit(".globl %s\n", fn->name);
+    emit("%s:\n", fn->name);
+    x86_func_name = fn->name;
+    x86_assign_lvar_offsets(fn);
+    x86_depth = 0;
+
+    // Prologue
+    emit("  push %%rbp\n");
+    emit("  mov %%rsp, %%rbp\n");
+    if (fn->local_var_stack_size)
+      emit("  sub $%d, %%rsp\n", fn->local_var_stack_size);
+
+    // 引数をスタックに保存する。7個目以降は呼び出し元のスタックにある
+    int i = 0;
+    for (VarList *vl = fn->params; vl; vl = vl->next, i++) {
+      Var *var = vl->var;
+      bool is_char = size_of(var->ty) == 1;
+      if (i < 6) {
+        emit("  mov %s, -%d(%%rbp)\n",
+             is_char ? x86_argreg8[i] : x86_argreg64[i], var->offset);
+        continue;
+      }
+      emit("  mov %d(%%rbp), %%rax\n", 16 + (i - 6) * 8);
+      emit("  mov %s, -%d(%%rbp)\n", is_char ? "%al" : "%rax", var->offset);
+    }
+
+    for (Node *n = fn->node; n; n = n->next)
+      x86_gen(n);
+
+    // Epilogue
+    emit(".L.return.%s:\n", x86_func_name);
+    emit("  mov %%rbp, %%rsp\n");
+    emit("  pop %%rbp\n");
+    emit("  ret\n");
+  }
+}
+
+// x86-64のアセンブリを生成して、行のリストとして返す
+Insn *emit_x86_64(Program *prog) {
+  x86_labelseq = 0;
+  x86_emit_data(prog);
+  x86_emit_text(prog);
+  Insn *list = insns;
+  insns = insns_tail = NULL;
+  return list;
+}
+
+void codegen_x86_64(Program *prog) { flush_insns(emit_x86_64(prog)); }
+
+Target target_x86_64 = {"x86-64", codegen_x86_64, emit_x86_64};
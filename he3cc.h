@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -8,6 +9,7 @@
 #include <string.h>
 
 typedef struct Type Type;
+typedef struct Insn Insn;
 
 //
 // tokenize.c
@@ -23,21 +25,25 @@ typedef enum {
 } TokenKind;
 
 // トークン型
+// トークンは配列tokensに並べて置き、パーサは添字token_posで読み進める
 typedef struct Token Token;
 struct Token {
   TokenKind kind; // トークンの型
-  Token *next;    // 次の入力トークン
-  int val;        // kindがTK_NUMの場合、その数値
-  char *str;      // トークン文字列
   int len;        // トークンの文字数
-
+  char *str;      // トークン文字列
+  union {
+    int val;          // kindがTK_NUMの場合、その数値
+    int contents_len; // kindがTK_STRの場合、文字列の長さ（\0含む）
+  };
   char *contents; // kindがTK_STRの場合、その文字列の内容（\0含む）
-  int contents_len; // 文字列の長さ（\0含む）
 };
 
 void error(char *fmt, ...);
 void error_at(char *loc, char *fmt, ...);
 void error_tok(Token *tok, char *fmt, ...);
+int line_number(char *loc);
+char *line_start(int line_num);
+int column_number(char *loc);
 Token *peek(char *s);
 Token *consume(char *op);
 void expect(char *op);
@@ -46,12 +52,13 @@ char *expect_ident();
 bool at_eof();
 char *duplicate_string_n(char *p, int len);
 Token *consume_ident();
-Token *new_token(TokenKind kind, Token *cur, char *str, int len);
-Token *tokenize();
+Token *new_token(TokenKind kind, char *str, int len);
+void tokenize();
 
-extern char *filename;
-extern char *user_input;
-extern Token *token;
+extern _Thread_local char *filename;
+extern _Thread_local char *user_input;
+extern _Thread_local Token *tokens;
+extern _Thread_local int token_pos;
 
 //
 // parse.c
@@ -59,31 +66,43 @@ extern Token *token;
 
 // 抽象構文木のノードの種類
 typedef enum {
-  ND_ADD,       // +
-  ND_SUB,       // -
-  ND_MUL,       // *
-  ND_DIV,       // /
-  ND_EQ,        // ==
-  ND_NE,        // !=
-  ND_LT,        // <
-  ND_LE,        // <=
-  ND_GT,        // >
-  ND_GE,        // >=
-  ND_ASSIGN,    // =
-  ND_ADDR,      // & アドレス演算子
-  ND_DEREF,     // * 間接参照演算子
-  ND_RETURN,    // "return"
-  ND_IF,        // "if"
-  ND_WHILE,     // "while"
-  ND_FOR,       // "for"
-  ND_SIZEOF,    // "sizeof"
-  ND_BLOCK,     // ブロック { ... }
-  ND_STMT_EXPR, // GNU拡張の式文 ({ ... })
-  ND_FUN_CALL,  // 関数呼び出し
-  ND_EXPR_STMT, // 式文
-  ND_VAR,       // 変数
-  ND_NUM,       // 整数
-  ND_NULL,      // 空文
+  ND_ADD,        // +
+  ND_SUB,        // -
+  ND_MUL,        // *
+  ND_DIV,        // /
+  ND_EQ,         // ==
+  ND_NE,         // !=
+  ND_LT,         // <
+  ND_LE,         // <=
+  ND_GT,         // >
+  ND_GE,         // >=
+  ND_LOGAND,     // &&
+  ND_LOGOR,      // ||
+  ND_NOT,        // !
+  ND_COND,       // ?:
+  ND_ASSIGN,     // =
+  ND_ADD_ASSIGN, // +=
+  ND_SUB_ASSIGN, // -=
+  ND_MUL_ASSIGN, // *=
+  ND_DIV_ASSIGN, // /=
+  ND_POST_INC,   // 後置++
+  ND_POST_DEC,   // 後置--
+  ND_ADDR,       // & アドレス演算子
+  ND_DEREF,      // * 間接参照演算子
+  ND_RETURN,     // "return"
+  ND_IF,         // "if"
+  ND_WHILE,      // "while"
+  ND_FOR,        // "for"
+  ND_SWITCH,     // "switch"
+  ND_CASE,       // "case", "default"
+  ND_BREAK,      // "break"
+  ND_BLOCK,      // ブロック { ... }
+  ND_STMT_EXPR,  // GNU拡張の式文 ({ ... })
+  ND_FUN_CALL,   // 関数呼び出し
+  ND_EXPR_STMT,  // 式文
+  ND_VAR,        // 変数
+  ND_NUM,        // 整数
+  ND_NULL,       // 空文
 } NodeKind;
 
 // 変数を表す型
@@ -95,6 +114,8 @@ struct Var {
 
   // ローカル変数の場合
   int offset; // RBP(ベースポインタ)からのオフセット
+  int scope;  // 宣言されたスコープの通し番号
+  char *reg;  // レジスタに割り当てた場合、そのレジスタ名
 
   // グローバル変数の場合（文字列リテラル用）
   char *contents;
@@ -108,30 +129,50 @@ struct VarList {
 };
 
 // 抽象構文木のノードの型
+// 種類ごとに使う欄だけを確保する。共通の欄の後ろは種類によって意味が
+// 変わるので、kindに合わない欄を読み書きしてはいけない (node_sizeを参照)
 typedef struct Node Node;
 struct Node {
   NodeKind kind; // ノードの型
+  int val;       // kindがND_NUM, ND_CASEの場合に使う数値
   Node *next;    // 次のノード
   Type *ty; // ノードの型情報 (現状はintまたはintへのポインタのみ)
   Token *tok; // ノードに対応するトークン
 
-  Node *lhs; // 左辺 (left-hand side)
-  Node *rhs; // 右辺 (right-hand side)
-  Var *var;  // kindがND_LOCAL_VARの場合に使う変数名
-  int val;   // kindがND_NUMの場合のみ使う数値
+  union {
+    // 演算子, ND_RETURN, ND_EXPR_STMT, ND_CASE, ND_SWITCH
+    struct {
+      Node *lhs; // 左辺 (left-hand side)、ND_CASEでは文
+      Node *rhs; // 右辺 (right-hand side)
+
+      // kindがND_SWITCH, ND_CASEの場合に使う
+      // (ND_SWITCHはcond, thenと合わせて使う)
+      Node *case_next;    // switch文に含まれるcaseのリスト
+      Node *default_case; // default節
+      int case_label;     // caseのラベル番号 (コード生成時に割り当てる)
+    };
 
-  // kindがND_IF, ND_WHILE, ND_FORの場合に使う
-  Node *cond; // 条件式
-  Node *then; // then節
-  Node *els;  // else節
-  Node *init; // 初期化文 (for文用)
-  Node *inc;  // 増分文 (for文用)
+    // kindがND_IF, ND_WHILE, ND_FOR, ND_COND, ND_SWITCHの場合に使う
+    struct {
+      Node *cond; // 条件式
+      Node *then; // then節
+      Node *els;  // else節
+      Node *init; // 初期化文 (for文用)
+      Node *inc;  // 増分文 (for文用)
+    };
 
-  // kindがND_FUN_CALLの場合に使う
-  char *func_name; // 関数名
-  Node *args;      // 引数リスト
+    // kindがND_VARの場合に使う
+    Var *var;
 
-  Node *body; // kindがND_BLOCK, ND_STMT_EXPRの場合に使う文のリスト
+    // kindがND_FUN_CALLの場合に使う
+    struct {
+      char *func_name; // 関数名
+      Node *args;      // 引数リスト
+    };
+
+    // kindがND_BLOCK, ND_STMT_EXPRの場合に使う文のリスト
+    Node *body;
+  };
 };
 
 // 関数を表す型
@@ -144,6 +185,11 @@ struct Function {
   Node *node;
   VarList *local_vars;
   int local_var_stack_size;
+
+  char *src;        // ソース中の関数定義の先頭
+  int src_len;      // 関数定義の長さ (閉じ括弧まで)
+  char *cache_path; // コードをキャッシュするファイル (使わなければNULL)
+  Insn *cached;     // キャッシュから読み込んだコード (なければNULL)
 };
 
 // プログラム全体を表す型
@@ -152,6 +198,14 @@ typedef struct {
   Function *fns;        // 関数リスト
 } Program;
 
+// 1つのノードが持つ子の欄の最大数
+#define MAX_CHILDREN 5
+
+int node_size(NodeKind kind);
+Node *new_node(NodeKind kind, Token *tok);
+Node *clone_node(Node *node);
+int child_slots(Node *node, Node **slots[MAX_CHILDREN]);
+Node *new_node_binary_op(NodeKind kind, Node *lhs, Node *rhs, Token *tok);
 Program *program();
 
 //
@@ -165,10 +219,13 @@ typedef enum {
   TY_ARRAY,
 } TypeKind;
 
+// 型は同じものを1つだけ作って共有する (インターン)。
+// 型が等しいかどうかはポインタを比べればよい
 struct Type {
   TypeKind kind;
   Type *base;     // ポインタ型の場合、指している型
   int array_size; // 配列型の場合、要素数
+  Type *next;     // 派生型の表で同じバケットにある次の型
 };
 
 Type *char_type();
@@ -177,10 +234,102 @@ Type *pointer_to(Type *base);
 Type *array_of(Type *base, int size);
 int size_of(Type *ty);
 
-void add_type(Program *prog);
+void add_type(Node *node);
+
+//
+// main.c
+//
+
+int align_to(int n, int align);
+void create_thread(pthread_t *thread, void *(*fn)(void *), void *arg);
+int compile_main(int argc, char **argv);
+
+//
+// optimize.c
+//
+
+extern int unroll_factor;
+extern int unroll_budget;
+
+bool is_speculatable(Node *node);
+void optimize(Program *prog);
+
+//
+// schedule.c
+//
+
+// 出力するアセンブリの1行 (命令・ラベル・ディレクティブ)
+struct Insn {
+  Insn *next;
+  char *text; // 改行を含まない行の内容
+};
+
+Insn *schedule(Insn *insns);
 
 //
 // codegen.c
 //
 
-void codegen(Program *prog);
+// コード生成の対象アーキテクチャ
+typedef struct Target Target;
+struct Target {
+  char *name;                     // --targetで指定する名前
+  void (*codegen)(Program *prog); // アセンブリを標準出力に書き出す
+  Insn *(*emit)(Program *prog);   // アセンブリを行のリストとして返す
+};
+
+extern Target target_arm64;
+
+extern int codegen_threads;
+extern _Thread_local Insn *insns;
+extern _Thread_local Insn *insns_tail;
+
+char *format(char *fmt, ...);
+void emit(char *fmt, ...);
+void flush_insns(Insn *list);
+Insn *emit_arm64(Program *prog);
+
+int compare_case(const void *a, const void *b);
+bool is_dense_cases(Node **cases, int ncases);
+
+//
+// codegen_x86.c
+//
+
+extern Target target_x86_64;
+
+Insn *emit_x86_64(Program *prog);
+
+//
+// jit.c
+//
+
+int jit_run(Program *prog);
+
+//
+// vm.c
+//
+
+int vm_run(Program *prog);
+
+//
+// object.c
+//
+
+void write_object(Program *prog, char *path);
+
+//
+// server.c
+//
+
+int run_server(char *path);
+int run_client(char *path, int argc, char **argv);
+
+//
+// cache.c
+//
+
+extern char *cache_dir;
+
+void load_cache(Program *prog);
+void store_cache(Function *fn, Insn *list);
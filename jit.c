@@ -0,0 +1,691 @@
+#define _GNU_SOURCE
+#include "he3cc.h"
+
+#include <dlfcn.h>
+#include <sys/mman.h>
+
+// JIT実行 (--run)
+//
+// x86-64版のコード生成が出力する行のリストを、その場で機械語に変換して
+// mmapした領域に置き、プロセス内でmainを呼び出す。アセンブラとリンカを
+// 起動しないので、小さなプログラムならすぐに実行が始まる。
+// 変換できるのはコード生成が出力する形の命令とディレクティブだけである。
+
+#ifdef __x86_64__
+
+// 出力先のセクション
+typedef enum {
+  SEC_TEXT,
+  SEC_DATA,
+} Section;
+
+// 機械語を書き込むバッファ
+typedef struct {
+  unsigned char *buf;
+  int len;
+  int cap;
+} Buffer;
+
+// ラベル (関数名・グローバル変数名・制御構文のラベル)
+typedef struct Label Label;
+struct Label {
+  Label *next;
+  char *name;
+  Section sec;
+  int offset;
+};
+
+// 後から値を埋めるアドレスの参照
+typedef enum {
+  FX_REL32,  // ラベルへのPC相対の4バイト (call, jmp, %ripからの参照)
+  FX_DIFF32, // 2つのラベルの差の4バイト (.long A - B)
+  FX_ABS64,  // ラベルまたは共有ライブラリのシンボルの8バイトアドレス
+} FixupKind;
+
+typedef struct Fixup Fixup;
+struct Fixup {
+  Fixup *next;
+  FixupKind kind;
+  Section sec; // 書き込む場所のセクション
+  int offset;  // 書き込む場所
+  int end;     // PC相対の基準となる命令の終わり
+  char *name;  // 参照するラベル
+  char *base;  // FX_DIFF32で引く側のラベル
+};
+
+// 命令のオペランド
+typedef enum {
+  OP_REG, // レジスタ
+  OP_IMM, // 即値
+  OP_MEM, // メモリ
+  OP_SYM, // ラベル (分岐先)
+} OperandKind;
+
+typedef struct {
+  OperandKind kind;
+  int reg;   // OP_REG: レジスタ番号
+  int size;  // OP_REG: バイト数 (1, 4, 8)
+  long imm;  // OP_IMM: 値
+  int base;  // OP_MEM: ベースレジスタ (-1なら%rip相対)
+  int index; // OP_MEM: インデックスレジスタ (-1ならなし)
+  int scale; // OP_MEM: インデックスの倍率
+  long disp; // OP_MEM: 変位
+  char *sym; // OP_MEM: %rip相対のラベル、OP_SYM: 分岐先
+  bool star; // 間接分岐の*が付いているか
+} Operand;
+
+// ラベルのハッシュ表の大きさ
+#define LABEL_BUCKETS 1024
+
+Buffer jit_text;
+Buffer jit_data;
+Section jit_cur_sec;
+Label *jit_labels[LABEL_BUCKETS];
+Fixup *jit_fixups;
+char *jit_cur_line;
+
+Buffer *jit_cur_buf(void) {
+  return jit_cur_sec == SEC_TEXT ? &jit_text : &jit_data;
+}
+
+void jit_put_byte(int b) {
+  Buffer *buf = jit_cur_buf();
+  if (buf->len == buf->cap) {
+    buf->cap = buf->cap ? buf->cap * 2 : 4096;
+    buf->buf = realloc(buf->buf, buf->cap);
+  }
+  buf->buf[buf->len++] = b;
+}
+
+void jit_put_bytes(long val, int size) {
+  for (int i = 0; i < size; i++)
+    jit_put_byte((val >> (i * 8)) & 0xff);
+}
+
+void jit_add_fixup(FixupKind kind, char *name, char *base, int end) {
+  Fixup *fx = calloc(1, sizeof(Fixup));
+  fx->kind = kind;
+  fx->sec = jit_cur_sec;
+  fx->offset = jit_cur_buf()->len;
+  fx->end = end;
+  fx->name = name;
+  fx->base = base;
+  fx->next = jit_fixups;
+  jit_fixups = fx;
+}
+
+unsigned int jit_hash(char *s) {
+  unsigned int h = 2166136261u; // FNV-1a
+  for (; *s; s++)
+    h = (h ^ (unsigned char)*s) * 16777619u;
+  return h % LABEL_BUCKETS;
+}
+
+Label *jit_find_label(char *name) {
+  for (Label *l = jit_labels[jit_hash(name)]; l; l = l->next)
+    if (!strcmp(l->name, name))
+      return l;
+  return NULL;
+}
+
+// 現在の位置にラベルを定義する
+void jit_add_label(char *name) {
+  if (jit_find_label(name))
+    error("ラベルが重複しています: %s", name);
+  Label *l = calloc(1, sizeof(Label));
+  l->name = name;
+  l->sec = jit_cur_sec;
+  l->offset = jit_cur_buf()->len;
+  l->next = jit_labels[jit_hash(name)];
+  jit_labels[jit_hash(name)] = l;
+}
+
+void jit_bad_line(void) {
+  error("--runで変換できない行です: %s", jit_cur_line);
+}
+
+// レジスタ名
+char *jit_reg64[] = {"rax", "rcx", "rdx", "rbx", "rsp", "rbp",
+                     "rsi", "rdi", "r8",  "r9",  "r10", "r11",
+                     "r12", "r13", "r14", "r15"};
+char *jit_reg32[] = {"eax", "ecx", "edx", "ebx", "esp", "ebp",
+                     "esi", "edi", "r8d", "r9d", "r10d", "r11d",
+                     "r12d", "r13d", "r14d", "r15d"};
+char *jit_reg8[] = {"al",  "cl",  "dl",   "bl",   "spl",  "bpl",
+                    "sil", "dil", "r8b",  "r9b",  "r10b", "r11b",
+                    "r12b", "r13b", "r14b", "r15b"};
+
+// %を除いたレジスタ名から番号と大きさを求める
+bool jit_parse_reg(char *s, int *reg, int *size) {
+  for (int i = 0; i < 16; i++) {
+    if (!strcmp(s, jit_reg64[i]))
+      *size = 8;
+    else if (!strcmp(s, jit_reg32[i]))
+      *size = 4;
+    else if (!strcmp(s, jit_reg8[i]))
+      *size = 1;
+    else
+      continue;
+    *reg = i;
+    return true;
+  }
+  return false;
+}
+
+// 文字列の前後の空白を取り除く
+char *jit_strip(char *s) {
+  while (isspace(*s))
+    s++;
+  char *end = s + strlen(s);
+  while (end > s && isspace(end[-1]))
+    *--end = '\0';
+  return s;
+}
+
+void jit_parse_operand(char *s, Operand *op) {
+  memset(op, 0, sizeof(*op));
+  s = jit_strip(s);
+  if (*s == '*') {
+    op->star = true;
+    s++;
+  }
+
+  if (*s == '%') {
+    op->kind = OP_REG;
+    if (!jit_parse_reg(s + 1, &op->reg, &op->size))
+      jit_bad_line();
+    return;
+  }
+
+  if (*s == '$') {
+    op->kind = OP_IMM;
+    char *end;
+    op->imm = strtol(s + 1, &end, 10);
+    if (*end)
+      jit_bad_line();
+    return;
+  }
+
+  char *paren = strchr(s, '(');
+  if (!paren) {
+    op->kind = OP_SYM;
+    op->sym = s;
+    return;
+  }
+
+  // disp(%base,%index,scale) または label(%rip)
+  op->kind = OP_MEM;
+  op->index = -1;
+  op->scale = 1;
+  *paren = '\0';
+  char *inner = paren + 1;
+  char *close = strchr(inner, ')');
+  if (!close)
+    jit_bad_line();
+  *close = '\0';
+
+  char *parts[3];
+  int n = 0;
+  parts[n++] = inner;
+  for (char *p = inner; *p && n < 3; p++) {
+    if (*p == ',') {
+      *p = '\0';
+      parts[n++] = p + 1;
+    }
+  }
+
+  int size;
+  char *base = jit_strip(parts[0]);
+  if (!strcmp(base, "%rip")) {
+    op->base = -1;
+    op->sym = s;
+    return;
+  }
+  if (*base != '%' || !jit_parse_reg(base + 1, &op->base, &size) || size != 8)
+    jit_bad_line();
+  if (n > 1) {
+    char *index = jit_strip(parts[1]);
+    if (*index != '%' || !jit_parse_reg(index + 1, &op->index, &size) ||
+        size != 8)
+      jit_bad_line();
+  }
+  if (n > 2)
+    op->scale = atoi(parts[2]);
+  if (*s) {
+    char *end;
+    op->disp = strtol(s, &end, 10);
+    if (*end)
+      jit_bad_line();
+  }
+}
+
+// REXプレフィックス・オペコード・ModR/M・SIB・変位・即値を出力する。
+// regはModR/Mのregフィールド (レジスタ番号か、オペコードの拡張 /digit)、
+// rmはレジスタかメモリのオペランド。wが真なら64bit演算にする
+void jit_encode(bool w, int reg, bool reg_byte, Operand *rm, char *opcode,
+                int oplen, long imm, int imm_size) {
+  int rex = (w ? 8 : 0) | (reg >= 8 ? 4 : 0);
+  if (rm->kind == OP_REG)
+    rex |= rm->reg >= 8 ? 1 : 0;
+  else
+    rex |= (rm->index >= 8 ? 2 : 0) | (rm->base >= 8 ? 1 : 0);
+
+  // %spl, %bpl, %sil, %dilを使うにはREXが必要
+  bool need_rex = (reg_byte && reg >= 4) ||
+                  (rm->kind == OP_REG && rm->size == 1 && rm->reg >= 4);
+  if (rex || need_rex)
+    jit_put_byte(0x40 | rex);
+  for (int i = 0; i < oplen; i++)
+    jit_put_byte((unsigned char)opcode[i]);
+
+  int r = (reg & 7) << 3;
+  if (rm->kind == OP_REG) {
+    jit_put_byte(0xc0 | r | (rm->reg & 7));
+  } else if (rm->base < 0) {
+    // %rip相対: 変位の後ろに即値が続くなら、その分だけ基準がずれる
+    jit_put_byte(0x05 | r);
+    jit_add_fixup(FX_REL32, rm->sym, NULL, jit_cur_buf()->len + 4 + imm_size);
+    jit_put_bytes(0, 4);
+  } else {
+    int mod;
+    if (rm->disp == 0 && (rm->base & 7) != 5)
+      mod = 0;
+    else if (-128 <= rm->disp && rm->disp <= 127)
+      mod = 1;
+    else
+      mod = 2;
+
+    if (rm->index >= 0 || (rm->base & 7) == 4) {
+      jit_put_byte((mod << 6) | r | 4);
+      int index = rm->index >= 0 ? rm->index & 7 : 4;
+      int scale = rm->scale == 8 ? 3 : rm->scale == 4 ? 2 : rm->scale == 2;
+      jit_put_byte((scale << 6) | (index << 3) | (rm->base & 7));
+    } else {
+      jit_put_byte((mod << 6) | r | (rm->base & 7));
+    }
+    if (mod == 1)
+      jit_put_bytes(rm->disp, 1);
+    else if (mod == 2)
+      jit_put_bytes(rm->disp, 4);
+  }
+  jit_put_bytes(imm, imm_size);
+}
+
+// 条件コードの番号
+int jit_cond_number(char *cc) {
+  static char *names[] = {"o", "no", "b", "ae", "e", "ne", "be", "a",
+                          "s", "ns", "p", "np", "l", "ge", "le", "g"};
+  for (int i = 0; i < 16; i++)
+    if (!strcmp(cc, names[i]))
+      return i;
+  return -1;
+}
+
+bool jit_is_imm8(long val) { return -128 <= val && val <= 127; }
+
+bool jit_is_imm32(long val) {
+  return -2147483648L <= val && val <= 2147483647L;
+}
+
+// add, sub, cmp, test, movのような2オペランドの演算
+typedef struct {
+  char *name;
+  int rm_reg; // op %reg, r/m
+  int reg_rm; // op r/m, %reg (なければ-1)
+  int digit;  // op $imm, r/mの/digit (なければ-1)
+} AluOp;
+
+AluOp jit_alu_ops[] = {
+    {"add", 0x01, 0x03, 0},   {"sub", 0x29, 0x2b, 5},
+    {"cmp", 0x39, 0x3b, 7},   {"test", 0x85, -1, -1},
+    {"mov", 0x89, 0x8b, -1},
+};
+
+void jit_encode_alu(AluOp *alu, Operand *src, Operand *dst) {
+  if (src->kind == OP_IMM) {
+    if (!jit_is_imm32(src->imm))
+      jit_bad_line();
+    if (!strcmp(alu->name, "mov")) {
+      if (dst->kind == OP_REG && dst->size == 4) {
+        if (dst->reg >= 8)
+          jit_put_byte(0x41);
+        jit_put_byte(0xb8 + (dst->reg & 7));
+        jit_put_bytes(src->imm, 4);
+        return;
+      }
+      jit_encode(true, 0, false, dst, "\xc7", 1, src->imm, 4);
+      return;
+    }
+    if (alu->digit < 0)
+      jit_bad_line();
+    if (jit_is_imm8(src->imm))
+      jit_encode(true, alu->digit, false, dst, "\x83", 1, src->imm, 1);
+    else
+      jit_encode(true, alu->digit, false, dst, "\x81", 1, src->imm, 4);
+    return;
+  }
+
+  if (src->kind == OP_REG) {
+    // 1バイトのストアはオペコードの最下位ビットを0にする
+    bool byte = src->size == 1;
+    char opcode = alu->rm_reg - byte;
+    jit_encode(src->size == 8, src->reg, byte, dst, &opcode, 1, 0, 0);
+    return;
+  }
+
+  if (src->kind == OP_MEM && dst->kind == OP_REG && alu->reg_rm >= 0) {
+    char opcode = alu->reg_rm;
+    jit_encode(dst->size == 8, dst->reg, false, src, &opcode, 1, 0, 0);
+    return;
+  }
+  jit_bad_line();
+}
+
+// 分岐先へのPC相対の4バイトを出力する
+void jit_put_rel32(char *sym) {
+  jit_add_fixup(FX_REL32, sym, NULL, jit_cur_buf()->len + 4);
+  jit_put_bytes(0, 4);
+}
+
+// 命令1つを機械語に変換する
+void jit_assemble_insn(char *mnemonic, Operand *ops, int n) {
+  for (int i = 0; i < sizeof(jit_alu_ops) / sizeof(*jit_alu_ops); i++) {
+    if (!strcmp(mnemonic, jit_alu_ops[i].name)) {
+      if (n != 2)
+        jit_bad_line();
+      jit_encode_alu(&jit_alu_ops[i], &ops[0], &ops[1]);
+      return;
+    }
+  }
+
+  if (!strcmp(mnemonic, "push") || !strcmp(mnemonic, "pop")) {
+    if (n != 1 || ops[0].kind != OP_REG || ops[0].size != 8)
+      jit_bad_line();
+    if (ops[0].reg >= 8)
+      jit_put_byte(0x41);
+    jit_put_byte((!strcmp(mnemonic, "push") ? 0x50 : 0x58) + (ops[0].reg & 7));
+    return;
+  }
+
+  if (!strcmp(mnemonic, "ret")) {
+    jit_put_byte(0xc3);
+    return;
+  }
+  if (!strcmp(mnemonic, "cqo")) {
+    jit_put_byte(0x48);
+    jit_put_byte(0x99);
+    return;
+  }
+
+  if (!strcmp(mnemonic, "lea") && n == 2 && ops[0].kind == OP_MEM &&
+      ops[1].kind == OP_REG) {
+    jit_encode(true, ops[1].reg, false, &ops[0], "\x8d", 1, 0, 0);
+    return;
+  }
+
+  if (!strcmp(mnemonic, "idiv") && n == 1) {
+    jit_encode(true, 7, false, &ops[0], "\xf7", 1, 0, 0);
+    return;
+  }
+
+  if (!strcmp(mnemonic, "imul")) {
+    if (n == 2 && ops[1].kind == OP_REG && ops[0].kind == OP_IMM) {
+      // imul $imm, %reg は imul $imm, %reg, %reg の省略形
+      if (jit_is_imm8(ops[0].imm))
+        jit_encode(true, ops[1].reg, false, &ops[1], "\x6b", 1, ops[0].imm, 1);
+      else
+        jit_encode(true, ops[1].reg, false, &ops[1], "\x69", 1, ops[0].imm, 4);
+      return;
+    }
+    if (n == 2 && ops[1].kind == OP_REG) {
+      jit_encode(true, ops[1].reg, false, &ops[0], "\x0f\xaf", 2, 0, 0);
+      return;
+    }
+    jit_bad_line();
+  }
+
+  // 符号拡張・ゼロ拡張付きのロードと移動
+  if (n == 2 && ops[1].kind == OP_REG) {
+    if (!strcmp(mnemonic, "movsbq")) {
+      jit_encode(true, ops[1].reg, false, &ops[0], "\x0f\xbe", 2, 0, 0);
+      return;
+    }
+    if (!strcmp(mnemonic, "movzbq")) {
+      jit_encode(true, ops[1].reg, false, &ops[0], "\x0f\xb6", 2, 0, 0);
+      return;
+    }
+    if (!strcmp(mnemonic, "movslq")) {
+      jit_encode(true, ops[1].reg, false, &ops[0], "\x63", 1, 0, 0);
+      return;
+    }
+  }
+
+  if (!strcmp(mnemonic, "call") && n == 1 && ops[0].kind == OP_SYM) {
+    jit_put_byte(0xe8);
+    jit_put_rel32(ops[0].sym);
+    return;
+  }
+
+  if (!strcmp(mnemonic, "jmp") && n == 1) {
+    if (ops[0].star) {
+      jit_encode(false, 4, false, &ops[0], "\xff", 1, 0, 0);
+      return;
+    }
+    jit_put_byte(0xe9);
+    jit_put_rel32(ops[0].sym);
+    return;
+  }
+
+  // 条件付きの命令 (jcc, setcc, cmovcc)
+  int cc;
+  if (*mnemonic == 'j' && (cc = jit_cond_number(mnemonic + 1)) >= 0 && n == 1 &&
+      ops[0].kind == OP_SYM) {
+    jit_put_byte(0x0f);
+    jit_put_byte(0x80 + cc);
+    jit_put_rel32(ops[0].sym);
+    return;
+  }
+  if (!strncmp(mnemonic, "set", 3) &&
+      (cc = jit_cond_number(mnemonic + 3)) >= 0 && n == 1) {
+    char opcode[] = {0x0f, 0x90 + cc};
+    jit_encode(false, 0, false, &ops[0], opcode, 2, 0, 0);
+    return;
+  }
+  if (!strncmp(mnemonic, "cmov", 4) &&
+      (cc = jit_cond_number(mnemonic + 4)) >= 0 && n == 2 &&
+      ops[1].kind == OP_REG) {
+    char opcode[] = {0x0f, 0x40 + cc};
+    jit_encode(true, ops[1].reg, false, &ops[0], opcode, 2, 0, 0);
+    return;
+  }
+
+  jit_bad_line();
+}
+
+// ディレクティブを処理する
+void jit_assemble_directive(char *name, char *args) {
+  if (!strcmp(name, ".text")) {
+    jit_cur_sec = SEC_TEXT;
+    return;
+  }
+  if (!strcmp(name, ".data")) {
+    jit_cur_sec = SEC_DATA;
+    return;
+  }
+  if (!strcmp(name, ".globl"))
+    return;
+  if (!strcmp(name, ".p2align")) {
+    int align = 1 << atoi(args);
+    while (jit_cur_buf()->len % align)
+      jit_put_byte(0);
+    return;
+  }
+  if (!strcmp(name, ".byte")) {
+    jit_put_byte(atoi(args));
+    return;
+  }
+  if (!strcmp(name, ".zero")) {
+    for (int i = atoi(args); i > 0; i--)
+      jit_put_byte(0);
+    return;
+  }
+  if (!strcmp(name, ".long")) {
+    // ジャンプテーブルの要素 (A - B)
+    char *minus = strstr(args, " - ");
+    if (!minus)
+      jit_bad_line();
+    *minus = '\0';
+    jit_add_fixup(FX_DIFF32, jit_strip(args), jit_strip(minus + 3), 0);
+    jit_put_bytes(0, 4);
+    return;
+  }
+  jit_bad_line();
+}
+
+// アセンブリ1行を機械語に変換する
+void jit_assemble_line(char *str) {
+  jit_cur_line = str;
+  char *line = jit_strip(strdup(str));
+  if (!*line)
+    return;
+
+  // ラベル
+  int len = strlen(line);
+  if (line[len - 1] == ':') {
+    line[len - 1] = '\0';
+    jit_add_label(line);
+    return;
+  }
+
+  char *args = line + len;
+  char *sp = strpbrk(line, " \t");
+  if (sp) {
+    *sp = '\0';
+    args = sp + 1;
+  }
+
+  if (*line == '.') {
+    jit_assemble_directive(line, args);
+    return;
+  }
+
+  // 括弧の外のカンマでオペランドを区切る
+  Operand ops[3];
+  int n = 0;
+  int paren = 0;
+  char *start = args;
+  for (char *p = args;; p++) {
+    if (*p == '(')
+      paren++;
+    else if (*p == ')')
+      paren--;
+    else if ((*p == ',' && paren == 0) || *p == '\0') {
+      bool last = *p == '\0';
+      *p = '\0';
+      if (*jit_strip(start)) {
+        if (n == 3)
+          jit_bad_line();
+        jit_parse_operand(start, &ops[n++]);
+      }
+      if (last)
+        break;
+      start = p + 1;
+    }
+  }
+  jit_assemble_insn(line, ops, n);
+}
+
+// ラベルまたは共有ライブラリのシンボルのアドレスを返す
+unsigned long jit_symbol_address(char *name, unsigned char *text_base,
+                                 unsigned char *data_base) {
+  Label *l = jit_find_label(name);
+  if (l)
+    return (unsigned long)(l->sec == SEC_TEXT ? text_base : data_base) +
+           l->offset;
+  void *addr = dlsym(RTLD_DEFAULT, name);
+  if (!addr)
+    error("未定義のシンボルです: %s", name);
+  return (unsigned long)addr;
+}
+
+// プログラムを機械語に変換してmainを呼び出し、その戻り値を返す
+int jit_run(Program *prog) {
+  for (Insn *insn = emit_x86_64(prog); insn; insn = insn->next)
+    jit_assemble_line(insn->text);
+
+  // 共有ライブラリの関数は2GBより遠くにあるかもしれないので、
+  // textの末尾に間接ジャンプのスタブを置いて、callはそこに飛ばす。
+  //   jmp *0(%rip)
+  //   .quad <アドレス>
+  jit_cur_sec = SEC_TEXT;
+  for (Fixup *fx = jit_fixups; fx; fx = fx->next) {
+    if (fx->kind != FX_REL32 || jit_find_label(fx->name))
+      continue;
+    char *stub = calloc(1, strlen(fx->name) + 8);
+    sprintf(stub, "%s@stub", fx->name);
+    if (!jit_find_label(stub)) {
+      jit_add_label(stub);
+      jit_put_byte(0xff);
+      jit_put_byte(0x25);
+      jit_put_bytes(0, 4);
+      jit_add_fixup(FX_ABS64, fx->name, NULL, 0);
+      jit_put_bytes(0, 8);
+    }
+    fx->name = stub;
+  }
+
+  // textとdataを1つの領域に並べ、%rip相対の参照が4バイトに収まるようにする
+  long page = 4096;
+  long text_size = align_to(jit_text.len, page);
+  long data_size = align_to(jit_data.len ? jit_data.len : 1, page);
+  unsigned char *mem = mmap(NULL, text_size + data_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    error("mmapに失敗しました: %s", strerror(errno));
+  unsigned char *text_base = mem;
+  unsigned char *data_base = mem + text_size;
+  memcpy(text_base, jit_text.buf, jit_text.len);
+  memcpy(data_base, jit_data.buf, jit_data.len);
+
+  for (Fixup *fx = jit_fixups; fx; fx = fx->next) {
+    unsigned char *base = fx->sec == SEC_TEXT ? text_base : data_base;
+    unsigned char *loc = base + fx->offset;
+    long val;
+    switch (fx->kind) {
+    case FX_REL32:
+      val = jit_symbol_address(fx->name, text_base, data_base) -
+            (unsigned long)(base + fx->end);
+      break;
+    case FX_DIFF32:
+      val = jit_symbol_address(fx->name, text_base, data_base) -
+            jit_symbol_address(fx->base, text_base, data_base);
+      break;
+    case FX_ABS64:
+      val = jit_symbol_address(fx->name, text_base, data_base);
+      memcpy(loc, &val, 8);
+      continue;
+    }
+    if (!jit_is_imm32(val))
+      error("アドレスが4バイトに収まりません: %s", fx->name);
+    int val32 = val;
+    memcpy(loc, &val32, 4);
+  }
+
+  if (mprotect(text_base, text_size, PROT_READ | PROT_EXEC))
+    error("mprotectに失敗しました: %s", strerror(errno));
+
+  Label *main_label = jit_find_label("main");
+  if (!main_label || main_label->sec != SEC_TEXT)
+    error("main関数がありません");
+  int (*main_fn)(void) = (int (*)(void))(text_base + main_label->offset);
+  return main_fn();
+}
+
+#else
+
+int jit_run(Program *prog) {
+  error("--runはx86-64のホストでのみ使えます");
+  return 1;
+}
+
+#endif
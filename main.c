@@ -1,9 +1,11 @@
 #include "he3cc.h"
 
-// ファイルの内容を読み込んで返す
+#include <pthread.h>
+
+// ファイルの内容を読み込んで返す。pathが "-" なら標準入力から読む
 char *read_file(char *path) {
   // Open and read the file.
-  FILE *fp = fopen(path, "r");
+  FILE *fp = strcmp(path, "-") ? fopen(path, "r") : stdin;
   if (!fp)
     error("ファイルを開けません %s: %s", path, strerror(errno));
 
@@ -12,6 +14,8 @@ char *read_file(char *path) {
   int size = fread(buf, 1, filemax - 2, fp);
   if (!feof(fp))
     error("%s: ファイルが大きすぎます", path);
+  if (fp != stdin)
+    fclose(fp);
 
   // 文字列が "\n\0" で終わることを保証
   if (size == 0 || buf[size - 1] != '\n')
@@ -22,38 +26,286 @@ char *read_file(char *path) {
 
 int align_to(int n, int align) { return (n + align - 1) & ~(align - 1); }
 
-int main(int argc, char **argv) {
-  if (argc != 2) {
-    error("引数の個数が正しくありません");
-    return 1;
-  }
+// 数値を取るオプションの値を読む
+int option_value(char *arg, char *name) {
+  char *end;
+  long val = strtol(arg + strlen(name), &end, 10);
+  if (*end || end == arg + strlen(name) || val < 1)
+    error("オプションの値が不正です: %s", arg);
+  return val;
+}
+
+// 出力ファイルの名前 (入力ファイル名の拡張子.cをextに置き換える)
+char *output_path(char *path, char *ext) {
+  char *base = strrchr(path, '/');
+  base = base ? base + 1 : path;
+  int len = strlen(base);
+  if (len > 2 && !strcmp(base + len - 2, ".c"))
+    len -= 2;
+  char *buf = calloc(1, len + strlen(ext) + 1);
+  memcpy(buf, base, len);
+  strcpy(buf + len, ext);
+  return buf;
+}
+
+// --targetで指定できるアーキテクチャ
+Target *targets[] = {&target_arm64, &target_x86_64};
+
+// 出力するアセンブリの種類
+Target *target = &target_arm64;
+
+// オブジェクトファイルを書き出すか (-c)
+bool compile_only;
+
+// 1つのファイルをパースして、最適化した構文木を返す。
+// 入力に関する状態はスレッドローカルなので、複数のスレッドで同時に呼べる
+Program *parse_file(char *path) {
+  filename = strcmp(path, "-") ? path : "<stdin>";
 
   // ファイルから読み込む
-  filename = argv[1];
-  user_input = read_file(argv[1]);
+  user_input = read_file(path);
 
   // トークナイズする
-  token = tokenize();
+  tokenize();
 
-  // パースする
+  // パースする (型はノードを作るときに付く)
   Program *prog = program();
 
-  // 型を付ける
-  add_type(prog);
+  // ARM64のコードを生成するときは、キャッシュにある関数を探す
+  if (target == &target_arm64)
+    load_cache(prog);
+
+  // 最適化する
+  optimize(prog);
+  return prog;
+}
+
+// 1つの翻訳単位をコンパイルし、outputに書き出す (NULLなら標準出力)
+void compile_file(char *input, char *output) {
+  Program *prog = parse_file(input);
+
+  if (compile_only) {
+    write_object(prog, output);
+    return;
+  }
+  if (!output) {
+    target->codegen(prog);
+    return;
+  }
+
+  FILE *out = fopen(output, "w");
+  if (!out)
+    error("ファイルを開けません %s: %s", output, strerror(errno));
+  for (Insn *insn = target->emit(prog); insn; insn = insn->next)
+    fprintf(out, "%s\n", insn->text);
+  fclose(out);
+}
+
+// コンパイラのスレッドのスタックの大きさ。最適化やコード生成は式の木を
+// 再帰的にたどるので、MAX_EXPR_DEPTH段の式をたどれる大きさにする。
+// 使った分しかメモリを消費しないので、大きめに取っておく
+#define THREAD_STACK_SIZE (256UL << 20)
+
+// スタックの大きなスレッドを作り、fn(arg)を実行させる
+void create_thread(pthread_t *thread, void *(*fn)(void *), void *arg) {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+  if (pthread_create(thread, &attr, fn, arg))
+    error("スレッドを作成できません");
+  pthread_attr_destroy(&attr);
+}
+
+// -jで並列にコンパイルするファイルの表
+typedef struct {
+  char **inputs;  // 入力ファイル
+  char **outputs; // 出力ファイル
+  int nfiles;     // ファイルの数
+  int next;       // 次に取り出すファイルの番号
+  pthread_mutex_t mutex;
+} CompileQueue;
+
+// 表からファイルを1つずつ取り出してコンパイルする
+void *compile_worker(void *arg) {
+  CompileQueue *q = arg;
+  for (;;) {
+    pthread_mutex_lock(&q->mutex);
+    int i = q->next++;
+    pthread_mutex_unlock(&q->mutex);
+    if (i >= q->nfiles)
+      return NULL;
+    compile_file(q->inputs[i], q->outputs[i]);
+  }
+}
 
-  for (Function *fn = prog->fns; fn; fn = fn->next) {
-    // ローカル変数のオフセットを決定する
-    int offset = 0;
-    for (VarList *var_list = fn->local_vars; var_list;
-         var_list = var_list->next) {
-      Var *var = var_list->var;
-      offset += size_of(var->ty);
-      var->offset = offset;
+// 使い方:
+//   he3cc [--target=T] [-c | --run | --vm] [--unroll=N] [--unroll-budget=N]
+//         [--threads=N] [-j N] [-o <output>] [--cache-dir=DIR] <file>...
+//     --target=T         出力するアセンブリの種類 (arm64 または x86-64)
+//     -c                 ARM64のオブジェクトファイル (<file>.o) を書き出す
+//     --run              アセンブリを出力せず、その場で機械語にして実行する
+//     --vm               アセンブリを出力せず、バイトコードにして実行する
+//     --unroll=N         計数ループを部分展開するときの本体の数 (1で無効)
+//     --unroll-budget=N  ループ展開後の本体の大きさの上限 (ノード数)
+//     --threads=N        ARM64のコードを並列に生成するスレッドの数
+//     -j N               並列にコンパイルするファイルの数
+//     -o <output>        出力ファイルの名前 (入力ファイルが1つのときのみ)
+//     --cache-dir=DIR    ARM64の関数ごとのコードをDIRにキャッシュする
+//
+// 入力ファイルが1つで-oがなければ、アセンブリは標準出力に書き出す。
+// 複数のときは、それぞれ<file>.s (-cでは<file>.o) に書き出す。
+// <file>が "-" なら標準入力からソースを読む
+int compile_main(int argc, char **argv) {
+  bool run = false;
+  bool vm = false;
+  int jobs = 1;
+  char *output = NULL;
+  char **inputs = calloc(argc, sizeof(char *));
+  int nfiles = 0;
+  for (int i = 1; i < argc; i++) {
+    if (!strncmp(argv[i], "--target=", 9)) {
+      target = NULL;
+      for (int j = 0; j < sizeof(targets) / sizeof(*targets); j++)
+        if (!strcmp(argv[i] + 9, targets[j]->name))
+          target = targets[j];
+      if (!target)
+        error("未対応のターゲットです: %s", argv[i] + 9);
+      continue;
     }
-    fn->local_var_stack_size = align_to(offset, 16);
+    if (!strcmp(argv[i], "-c")) {
+      compile_only = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "--run")) {
+      run = true;
+      continue;
+    }
+    if (!strcmp(argv[i], "--vm")) {
+      vm = true;
+      continue;
+    }
+    if (!strncmp(argv[i], "--unroll=", 9)) {
+      unroll_factor = option_value(argv[i], "--unroll=");
+      continue;
+    }
+    if (!strncmp(argv[i], "--unroll-budget=", 16)) {
+      unroll_budget = option_value(argv[i], "--unroll-budget=");
+      continue;
+    }
+    if (!strncmp(argv[i], "--threads=", 10)) {
+      codegen_threads = option_value(argv[i], "--threads=");
+      continue;
+    }
+    if (!strncmp(argv[i], "-j", 2)) {
+      if (argv[i][2])
+        jobs = option_value(argv[i], "-j");
+      else if (i + 1 < argc)
+        jobs = option_value(argv[++i], "");
+      else
+        error("-jの後に数がありません");
+      continue;
+    }
+    if (!strncmp(argv[i], "--cache-dir=", 12)) {
+      cache_dir = argv[i] + 12;
+      continue;
+    }
+    if (!strcmp(argv[i], "-o")) {
+      if (i + 1 == argc)
+        error("-oの後にファイル名がありません");
+      output = argv[++i];
+      continue;
+    }
+    inputs[nfiles++] = argv[i];
+  }
+  if (nfiles == 0)
+    error("引数の個数が正しくありません");
+  if (compile_only && target != &target_arm64)
+    error("-cはarm64のみ対応しています");
+
+  // 実行する
+  if (run || vm) {
+    if (nfiles > 1 || output)
+      error("--runと--vmには1つのファイルだけを指定してください");
+    cache_dir = NULL;
+    Program *prog = parse_file(inputs[0]);
+    return run ? jit_run(prog) : vm_run(prog);
+  }
+
+  // 1つのファイルをコンパイルする
+  if (nfiles == 1) {
+    if (!output && compile_only)
+      output = output_path(inputs[0], ".o");
+    compile_file(inputs[0], output);
+    return 0;
   }
-  // コード生成する
-  codegen(prog);
 
+  // 複数のファイルを、jobs個のスレッドで並列にコンパイルする。
+  // ファイル単位で並列化するので、関数単位の並列化は指定がなければ行わない
+  if (output)
+    error("入力ファイルが複数のときは-oを指定できません");
+  if (!codegen_threads)
+    codegen_threads = 1;
+
+  CompileQueue q = {0};
+  q.inputs = inputs;
+  q.outputs = calloc(nfiles, sizeof(char *));
+  q.nfiles = nfiles;
+  for (int i = 0; i < nfiles; i++)
+    q.outputs[i] = output_path(inputs[i], compile_only ? ".o" : ".s");
+  pthread_mutex_init(&q.mutex, NULL);
+
+  if (jobs > nfiles)
+    jobs = nfiles;
+  pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+  for (int i = 1; i < jobs; i++)
+    create_thread(&threads[i], compile_worker, &q);
+  compile_worker(&q);
+  for (int i = 1; i < jobs; i++)
+    pthread_join(threads[i], NULL);
   return 0;
 }
+
+// 使い方:
+//   he3cc --server=<socket>
+//     ソケットで待ち受けるコンパイルサーバーとして動く
+//   he3cc --client=<socket> <引数>...
+//     引数をサーバーに送ってコンパイルさせる。出力と終了コードは
+//     直接実行したときと同じ。サーバーに接続できなければ自分でコンパイルする
+//   he3cc <引数>...
+//     コンパイルする (compile_mainを参照)
+int run_main(int argc, char **argv) {
+  if (argc > 1 && !strncmp(argv[1], "--server=", 9))
+    return run_server(argv[1] + 9);
+
+  if (argc > 1 && !strncmp(argv[1], "--client=", 9)) {
+    int code = run_client(argv[1] + 9, argc - 2, argv + 2);
+    if (code >= 0)
+      return code;
+    argv[1] = argv[0];
+    return compile_main(argc - 1, argv + 1);
+  }
+
+  return compile_main(argc, argv);
+}
+
+// mainの引数と終了コード
+typedef struct {
+  int argc;
+  char **argv;
+  int code;
+} MainArgs;
+
+void *main_thread(void *arg) {
+  MainArgs *m = arg;
+  m->code = run_main(m->argc, m->argv);
+  return NULL;
+}
+
+// 深い式をたどれるように、スタックの大きなスレッドで動かす
+int main(int argc, char **argv) {
+  MainArgs m = {argc, argv};
+  pthread_t thread;
+  create_thread(&thread, main_thread, &m);
+  pthread_join(thread, NULL);
+  return m.code;
+}
@@ -0,0 +1,1051 @@
+#include "he3cc.h"
+
+#include <elf.h>
+
+// オブジェクトファイルの出力 (-c)
+//
+// ARM64のコード生成が出力する行のリストを機械語に変換し、ELF64の
+// リロケータブルオブジェクトとして書き出す。外部のアセンブラを使わずに、
+// そのままシステムのリンカに渡せる。
+// 変換できるのはコード生成が出力する形の命令とディレクティブだけである。
+
+// セクション
+typedef enum {
+  SEC_TEXT,
+  SEC_DATA,
+  SEC_RODATA,
+  SEC_BSS,
+  NUM_SECS,
+} Section;
+
+char *sec_names[] = {".text", ".data", ".rodata", ".bss"};
+
+// セクションの中身
+typedef struct {
+  unsigned char *buf; // bssでは使わない
+  int len;
+  int cap;
+  int align;
+} Buffer;
+
+// ラベル
+typedef struct Label Label;
+struct Label {
+  Label *next;
+  char *name;
+  Section sec;
+  int offset;
+  int sym; // シンボルテーブルでの番号 (グローバルなシンボルのみ)
+};
+
+// 後から値を埋める参照
+typedef enum {
+  FX_JUMP26, // b, bl: 26bitのPC相対 (定義がなければリロケーション)
+  FX_COND19, // b.cond, cbz, cbnz: 19bitのPC相対
+  FX_ADR21,  // adr: 21bitのPC相対
+  FX_DIFF32, // .word A - B
+  FX_RELOC,  // 常にリロケーションを出力する (adrp, :lo12:)
+} FixupKind;
+
+typedef struct Fixup Fixup;
+struct Fixup {
+  Fixup *next;
+  FixupKind kind;
+  Section sec;
+  int offset;
+  char *name;  // 参照するシンボル
+  char *base;  // FX_DIFF32で引く側のラベル
+  long addend; // シンボルに足す値
+  int type;    // リロケーションの種類 (R_AARCH64_*)
+};
+
+// リロケーション (.rela.text の1項目)
+typedef struct Reloc Reloc;
+struct Reloc {
+  Reloc *next;
+  int offset;
+  char *name;
+  long addend;
+  int type;
+};
+
+// ラベルのハッシュ表の大きさ
+#define LABEL_BUCKETS 1024
+
+_Thread_local Buffer secs[NUM_SECS];
+_Thread_local Section cur_sec;
+_Thread_local Label *labels[LABEL_BUCKETS];
+_Thread_local Fixup *fixups;
+_Thread_local Reloc *relocs;
+_Thread_local char *cur_line;
+
+// .globlで指定された名前
+_Thread_local char **globals;
+_Thread_local int num_globals;
+
+// マッピングシンボル。textの中で命令 ($x) とデータ ($d) が始まる位置を
+// 逆アセンブラやリンカに知らせる
+typedef struct Mapping Mapping;
+struct Mapping {
+  Mapping *next;
+  bool is_data;
+  int offset;
+};
+
+_Thread_local Mapping *mappings;
+
+Buffer *cur_buf(void) { return &secs[cur_sec]; }
+
+void bad_line(void) { error("-cで変換できない行です: %s", cur_line); }
+
+void put_byte(int b) {
+  Buffer *buf = cur_buf();
+  if (cur_sec == SEC_BSS) {
+    if (b)
+      bad_line();
+    buf->len++;
+    return;
+  }
+  if (buf->len == buf->cap) {
+    buf->cap = buf->cap ? buf->cap * 2 : 4096;
+    buf->buf = realloc(buf->buf, buf->cap);
+  }
+  buf->buf[buf->len++] = b;
+}
+
+// textの中で命令とデータが切り替わる位置にマッピングシンボルを置く
+void mark_mapping(bool is_data) {
+  if (cur_sec != SEC_TEXT || (mappings && mappings->is_data == is_data))
+    return;
+  Mapping *m = calloc(1, sizeof(Mapping));
+  m->is_data = is_data;
+  m->offset = cur_buf()->len;
+  m->next = mappings;
+  mappings = m;
+}
+
+void put_word(unsigned int w) {
+  for (int i = 0; i < 4; i++)
+    put_byte((w >> (i * 8)) & 0xff);
+}
+
+void add_fixup(FixupKind kind, char *name, long addend, int type) {
+  Fixup *fx = calloc(1, sizeof(Fixup));
+  fx->kind = kind;
+  fx->sec = cur_sec;
+  fx->offset = cur_buf()->len;
+  fx->name = name;
+  fx->addend = addend;
+  fx->type = type;
+  fx->next = fixups;
+  fixups = fx;
+}
+
+unsigned int hash(char *s) {
+  unsigned int h = 2166136261u; // FNV-1a
+  for (; *s; s++)
+    h = (h ^ (unsigned char)*s) * 16777619u;
+  return h % LABEL_BUCKETS;
+}
+
+Label *find_label(char *name) {
+  for (Label *l = labels[hash(name)]; l; l = l->next)
+    if (!strcmp(l->name, name))
+      return l;
+  return NULL;
+}
+
+void add_label(char *name) {
+  if (find_label(name))
+    error("ラベルが重複しています: %s", name);
+  Label *l = calloc(1, sizeof(Label));
+  l->name = name;
+  l->sec = cur_sec;
+  l->offset = cur_buf()->len;
+  l->next = labels[hash(name)];
+  labels[hash(name)] = l;
+}
+
+// .Lで始まるラベルはファイルの中だけで使い、シンボルテーブルに載せない
+bool is_local_label(char *name) { return !strncmp(name, ".L", 2); }
+
+bool is_global(char *name) {
+  for (int i = 0; i < num_globals; i++)
+    if (!strcmp(globals[i], name))
+      return true;
+  return false;
+}
+
+//
+// 命令の変換
+//
+
+// 文字列の前後の空白を取り除く
+char *strip(char *s) {
+  while (isspace(*s))
+    s++;
+  char *end = s + strlen(s);
+  while (end > s && isspace(end[-1]))
+    *--end = '\0';
+  return s;
+}
+
+// レジスタの番号を返す。sp, xzr, wzrは31になる。
+// sfには64bitレジスタかどうかを返す
+int parse_reg(char *s, bool *sf) {
+  bool is64 = true;
+  int reg = -1;
+  if (!strcmp(s, "sp") || !strcmp(s, "xzr")) {
+    reg = 31;
+  } else if (!strcmp(s, "wsp") || !strcmp(s, "wzr")) {
+    is64 = false;
+    reg = 31;
+  } else if (*s == 'x' || *s == 'w') {
+    char *end;
+    reg = strtol(s + 1, &end, 10);
+    if (end == s + 1 || *end || reg < 0 || reg > 30)
+      reg = -1;
+    is64 = *s == 'x';
+  }
+  if (reg < 0)
+    bad_line();
+  if (sf)
+    *sf = is64;
+  return reg;
+}
+
+bool is_sp(char *s) { return !strcmp(s, "sp") || !strcmp(s, "wsp"); }
+
+bool is_reg_operand(char *s) {
+  return *s == 'x' || *s == 'w' || is_sp(s);
+}
+
+// 即値 (#は省略できる)
+long parse_imm(char *s) {
+  if (*s == '#')
+    s++;
+  char *end;
+  long val = strtol(s, &end, 10);
+  if (end == s || *end)
+    bad_line();
+  return val;
+}
+
+// sym または sym+N
+char *parse_sym(char *s, long *addend) {
+  *addend = 0;
+  char *plus = strchr(s, '+');
+  if (plus) {
+    *plus = '\0';
+    *addend = parse_imm(plus + 1);
+  }
+  return s;
+}
+
+// "lsl #N" のシフト量
+int parse_lsl(char *s) {
+  if (strncmp(s, "lsl ", 4))
+    bad_line();
+  return parse_imm(strip(s + 4));
+}
+
+// 条件コードの番号
+int cond_number(char *cc) {
+  static char *names[] = {"eq", "ne", "hs", "lo", "mi", "pl", "vs", "vc",
+                          "hi", "ls", "ge", "lt", "gt", "le", "al"};
+  for (int i = 0; i < 15; i++)
+    if (!strcmp(cc, names[i]))
+      return i;
+  if (!strcmp(cc, "cs"))
+    return 2;
+  if (!strcmp(cc, "cc"))
+    return 3;
+  bad_line();
+  return -1;
+}
+
+// メモリオペランド
+typedef struct {
+  int base;
+  int index;   // -1ならなし
+  int shift;   // インデックスのシフト量
+  long disp;   // 変位
+  char *sym;   // :lo12:のシンボル
+  long addend; // シンボルに足す値
+  bool pre;    // [base, #imm]!
+  bool post;   // [base], #imm
+} Mem;
+
+void parse_mem(char **ops, int n, int i, Mem *mem) {
+  memset(mem, 0, sizeof(*mem));
+  mem->index = -1;
+
+  char *s = ops[i];
+  int len = strlen(s);
+  if (s[len - 1] == '!') {
+    mem->pre = true;
+    s[--len] = '\0';
+  }
+  if (*s != '[' || s[len - 1] != ']')
+    bad_line();
+  s[len - 1] = '\0';
+  s++;
+
+  // 括弧の中をカンマで区切る
+  char *parts[3];
+  int np = 0;
+  parts[np++] = s;
+  for (char *p = s; *p && np < 3; p++) {
+    if (*p == ',') {
+      *p = '\0';
+      parts[np++] = p + 1;
+    }
+  }
+  for (int j = 0; j < np; j++)
+    parts[j] = strip(parts[j]);
+
+  mem->base = parse_reg(parts[0], NULL);
+  if (np >= 2) {
+    if (!strncmp(parts[1], ":lo12:", 6))
+      mem->sym = parse_sym(parts[1] + 6, &mem->addend);
+    else if (is_reg_operand(parts[1]))
+      mem->index = parse_reg(parts[1], NULL);
+    else
+      mem->disp = parse_imm(parts[1]);
+  }
+  if (np == 3)
+    mem->shift = parse_lsl(parts[2]);
+
+  if (n == i + 2) {
+    mem->post = true;
+    mem->disp = parse_imm(ops[i + 1]);
+  } else if (n != i + 1) {
+    bad_line();
+  }
+}
+
+// 64bit演算を表す最上位ビット
+unsigned int sf_bit(bool sf) { return sf ? 0x80000000 : 0; }
+
+// ロード・ストア命令 (符号なしオフセット形式のオペコードと、アクセスする
+// バイト数の対数)
+typedef struct {
+  char *name;
+  bool sf;          // 64bitレジスタか
+  unsigned int opc; // LDR/STR (immediate, unsigned offset)
+  int size;         // log2(バイト数)
+  int lo12;         // :lo12:のリロケーション
+} LoadStore;
+
+LoadStore load_stores[] = {
+    {"ldr", true, 0xf9400000, 3, R_AARCH64_LDST64_ABS_LO12_NC},
+    {"ldr", false, 0xb9400000, 2, R_AARCH64_LDST32_ABS_LO12_NC},
+    {"str", true, 0xf9000000, 3, R_AARCH64_LDST64_ABS_LO12_NC},
+    {"str", false, 0xb9000000, 2, R_AARCH64_LDST32_ABS_LO12_NC},
+    {"ldrsb", true, 0x39800000, 0, R_AARCH64_LDST8_ABS_LO12_NC},
+    {"ldrsb", false, 0x39c00000, 0, R_AARCH64_LDST8_ABS_LO12_NC},
+    {"ldrb", false, 0x39400000, 0, R_AARCH64_LDST8_ABS_LO12_NC},
+    {"strb", false, 0x39000000, 0, R_AARCH64_LDST8_ABS_LO12_NC},
+    {"ldrsw", true, 0xb9800000, 2, R_AARCH64_LDST32_ABS_LO12_NC},
+};
+
+void encode_load_store(LoadStore *ls, int rt, Mem *mem) {
+  unsigned int base = (mem->base << 5) | rt;
+  // 符号なしオフセット以外の形式はオペコードの24bit目が0になる
+  unsigned int unscaled = ls->opc & ~0x01000000;
+
+  if (mem->sym) {
+    add_fixup(FX_RELOC, mem->sym, mem->addend, ls->lo12);
+    put_word(ls->opc | base);
+    return;
+  }
+  if (mem->index >= 0) {
+    if (mem->shift && mem->shift != ls->size)
+      bad_line();
+    put_word(unscaled | (1 << 21) | (mem->index << 16) | (3 << 13) |
+             ((mem->shift ? 1 : 0) << 12) | (2 << 10) | base);
+    return;
+  }
+  if (mem->pre || mem->post) {
+    if (mem->disp < -256 || mem->disp > 255)
+      bad_line();
+    put_word(unscaled | ((mem->disp & 0x1ff) << 12) |
+             ((mem->pre ? 3 : 1) << 10) | base);
+    return;
+  }
+  long scaled = mem->disp >> ls->size;
+  if (mem->disp >= 0 && (scaled << ls->size) == mem->disp && scaled < 4096) {
+    put_word(ls->opc | (scaled << 10) | base);
+    return;
+  }
+  // ldur/stur
+  if (mem->disp < -256 || mem->disp > 255)
+    bad_line();
+  put_word(unscaled | ((mem->disp & 0x1ff) << 12) | base);
+}
+
+// ldp/stp (64bitレジスタのみ)
+void encode_pair(bool load, int rt, int rt2, Mem *mem) {
+  if (mem->index >= 0 || mem->sym || mem->disp % 8 || mem->disp < -512 ||
+      mem->disp > 504)
+    bad_line();
+  unsigned int opc = 0xa9000000;
+  if (mem->pre)
+    opc = 0xa9800000;
+  else if (mem->post)
+    opc = 0xa8800000;
+  if (load)
+    opc |= 1 << 22;
+  put_word(opc | (((mem->disp / 8) & 0x7f) << 15) | (rt2 << 10) |
+           (mem->base << 5) | rt);
+}
+
+// add/sub/cmp/cmnの即値形式。負の即値は逆の演算にする
+void encode_add_imm(bool sf, bool sub, bool setflags, int rd, int rn,
+                    long imm) {
+  if (imm < 0) {
+    imm = -imm;
+    sub = !sub;
+  }
+  int sh = 0;
+  if (imm >= 4096) {
+    if (imm & 0xfff || imm >= (1 << 24))
+      bad_line();
+    imm >>= 12;
+    sh = 1;
+  }
+  put_word(sf_bit(sf) | (sub << 30) | (setflags << 29) | 0x11000000 |
+           (sh << 22) | (imm << 10) | (rn << 5) | rd);
+}
+
+// add/sub/cmp/cmnのレジスタ形式。spを使うときは拡張レジスタ形式にする
+void encode_add_reg(bool sf, bool sub, bool setflags, int rd, bool rd_sp,
+                    int rn, bool rn_sp, int rm, int shift) {
+  unsigned int op = sf_bit(sf) | (sub << 30) | (setflags << 29);
+  if (rd_sp || rn_sp) {
+    if (shift > 4)
+      bad_line();
+    put_word(op | 0x0b200000 | (rm << 16) | ((sf ? 3 : 2) << 13) |
+             (shift << 10) | (rn << 5) | rd);
+    return;
+  }
+  put_word(op | 0x0b000000 | (rm << 16) | (shift << 10) | (rn << 5) | rd);
+}
+
+// movz/movn/movk
+void encode_mov_wide(bool sf, int opc, int rd, long imm, int shift) {
+  if (imm < 0 || imm > 0xffff || shift % 16 || shift >= (sf ? 64 : 32))
+    bad_line();
+  put_word(sf_bit(sf) | (opc << 29) | 0x12800000 | ((shift / 16) << 21) |
+           (imm << 5) | rd);
+}
+
+// 命令1つを機械語に変換する
+void assemble_insn(char *op, char **ops, int n) {
+  bool sf;
+
+  if (!strcmp(op, "ret") && n == 0) {
+    put_word(0xd65f03c0);
+    return;
+  }
+
+  // 分岐
+  if ((!strcmp(op, "b") || !strcmp(op, "bl")) && n == 1) {
+    bool link = op[1] == 'l';
+    long addend;
+    char *sym = parse_sym(ops[0], &addend);
+    add_fixup(FX_JUMP26, sym, addend,
+              link ? R_AARCH64_CALL26 : R_AARCH64_JUMP26);
+    put_word(link ? 0x94000000 : 0x14000000);
+    return;
+  }
+  if (!strncmp(op, "b.", 2) && n == 1) {
+    add_fixup(FX_COND19, ops[0], 0, 0);
+    put_word(0x54000000 | cond_number(op + 2));
+    return;
+  }
+  if ((!strcmp(op, "cbz") || !strcmp(op, "cbnz")) && n == 2) {
+    int rt = parse_reg(ops[0], &sf);
+    add_fixup(FX_COND19, ops[1], 0, 0);
+    put_word(sf_bit(sf) | (!strcmp(op, "cbnz") << 24) | 0x34000000 | rt);
+    return;
+  }
+  if (!strcmp(op, "br") && n == 1) {
+    put_word(0xd61f0000 | (parse_reg(ops[0], NULL) << 5));
+    return;
+  }
+
+  // アドレスの計算
+  if (!strcmp(op, "adr") && n == 2) {
+    int rd = parse_reg(ops[0], NULL);
+    add_fixup(FX_ADR21, ops[1], 0, 0);
+    put_word(0x10000000 | rd);
+    return;
+  }
+  if (!strcmp(op, "adrp") && n == 2) {
+    int rd = parse_reg(ops[0], NULL);
+    long addend;
+    char *sym = parse_sym(ops[1], &addend);
+    add_fixup(FX_RELOC, sym, addend, R_AARCH64_ADR_PREL_PG_HI21);
+    put_word(0x90000000 | rd);
+    return;
+  }
+
+  // ロード・ストア
+  if ((!strcmp(op, "ldp") || !strcmp(op, "stp")) && n >= 3) {
+    Mem mem;
+    parse_mem(ops, n, 2, &mem);
+    encode_pair(*op == 'l', parse_reg(ops[0], NULL), parse_reg(ops[1], NULL),
+                &mem);
+    return;
+  }
+  for (int i = 0; i < sizeof(load_stores) / sizeof(*load_stores); i++) {
+    LoadStore *ls = &load_stores[i];
+    if (strcmp(op, ls->name) || n < 2)
+      continue;
+    int rt = parse_reg(ops[0], &sf);
+    if (sf != ls->sf)
+      continue;
+    Mem mem;
+    parse_mem(ops, n, 1, &mem);
+    encode_load_store(ls, rt, &mem);
+    return;
+  }
+
+  // 加減算と比較
+  bool is_add = !strcmp(op, "add");
+  bool is_sub = !strcmp(op, "sub");
+  bool is_cmp = !strcmp(op, "cmp");
+  bool is_cmn = !strcmp(op, "cmn");
+  if (is_add || is_sub || is_cmp || is_cmn) {
+    // cmp/cmnはゼロレジスタに書き込むsubs/addsの別名
+    char **src = (is_cmp || is_cmn) ? ops : ops + 1;
+    int nsrc = (is_cmp || is_cmn) ? n : n - 1;
+    bool setflags = is_cmp || is_cmn;
+    bool sub = is_sub || is_cmp;
+    int rd = setflags ? 31 : parse_reg(ops[0], &sf);
+    bool rd_sp = !setflags && is_sp(ops[0]);
+    int rn = parse_reg(src[0], &sf);
+    if (nsrc < 2)
+      bad_line();
+
+    if (!strncmp(src[1], ":lo12:", 6)) {
+      long addend;
+      char *sym = parse_sym(src[1] + 6, &addend);
+      add_fixup(FX_RELOC, sym, addend, R_AARCH64_ADD_ABS_LO12_NC);
+      encode_add_imm(sf, sub, setflags, rd, rn, 0);
+      return;
+    }
+    if (!is_reg_operand(src[1])) {
+      encode_add_imm(sf, sub, setflags, rd, rn, parse_imm(src[1]));
+      return;
+    }
+    int rm = parse_reg(src[1], NULL);
+    int shift = nsrc == 3 ? parse_lsl(src[2]) : 0;
+    encode_add_reg(sf, sub, setflags, rd, rd_sp, rn, is_sp(src[0]), rm, shift);
+    return;
+  }
+
+  if (!strcmp(op, "mov") && n == 2) {
+    int rd = parse_reg(ops[0], &sf);
+    if (!is_reg_operand(ops[1])) {
+      // movz、または負の値ならmovn
+      long imm = parse_imm(ops[1]);
+      if (imm >= 0)
+        encode_mov_wide(sf, 2, rd, imm, 0);
+      else
+        encode_mov_wide(sf, 0, rd, ~imm & (sf ? -1L : 0xffffffffL), 0);
+      return;
+    }
+    int rm = parse_reg(ops[1], NULL);
+    if (is_sp(ops[0]) || is_sp(ops[1])) {
+      // spとの間の移動は add rd, rn, #0
+      encode_add_imm(sf, false, false, rd, rm, 0);
+      return;
+    }
+    // orr rd, zr, rm
+    put_word(sf_bit(sf) | 0x2a0003e0 | (rm << 16) | rd);
+    return;
+  }
+
+  bool is_movz = !strcmp(op, "movz");
+  bool is_movn = !strcmp(op, "movn");
+  if ((is_movz || is_movn || !strcmp(op, "movk")) && (n == 2 || n == 3)) {
+    int rd = parse_reg(ops[0], &sf);
+    int shift = n == 3 ? parse_lsl(ops[2]) : 0;
+    encode_mov_wide(sf, is_movn ? 0 : is_movz ? 2 : 3, rd, parse_imm(ops[1]),
+                    shift);
+    return;
+  }
+
+  // 乗除算
+  if ((!strcmp(op, "mul") && n == 3) ||
+      ((!strcmp(op, "madd") || !strcmp(op, "msub")) && n == 4)) {
+    int rd = parse_reg(ops[0], &sf);
+    int rn = parse_reg(ops[1], NULL);
+    int rm = parse_reg(ops[2], NULL);
+    int ra = n == 4 ? parse_reg(ops[3], NULL) : 31;
+    bool neg = !strcmp(op, "msub");
+    put_word(sf_bit(sf) | 0x1b000000 | (rm << 16) | (neg << 15) | (ra << 10) |
+             (rn << 5) | rd);
+    return;
+  }
+  if (!strcmp(op, "sdiv") && n == 3) {
+    int rd = parse_reg(ops[0], &sf);
+    put_word(sf_bit(sf) | 0x1ac00c00 | (parse_reg(ops[2], NULL) << 16) |
+             (parse_reg(ops[1], NULL) << 5) | rd);
+    return;
+  }
+
+  // 条件付きの選択
+  if (!strcmp(op, "cset") && n == 2) {
+    // csinc rd, zr, zr, !cond
+    int rd = parse_reg(ops[0], &sf);
+    int cond = cond_number(ops[1]) ^ 1;
+    put_word(sf_bit(sf) | 0x1a800400 | (31 << 16) | (cond << 12) | (31 << 5) |
+             rd);
+    return;
+  }
+  if ((!strcmp(op, "csel") || !strcmp(op, "csinc")) && n == 4) {
+    int rd = parse_reg(ops[0], &sf);
+    int rn = parse_reg(ops[1], NULL);
+    int rm = parse_reg(ops[2], NULL);
+    int cond = cond_number(ops[3]);
+    bool inc = !strcmp(op, "csinc");
+    put_word(sf_bit(sf) | 0x1a800000 | (rm << 16) | (cond << 12) | (inc << 10) |
+             (rn << 5) | rd);
+    return;
+  }
+
+  // sxtb rd, wn (sbfm rd, rn, #0, #7)
+  if (!strcmp(op, "sxtb") && n == 2) {
+    int rd = parse_reg(ops[0], &sf);
+    int rn = parse_reg(ops[1], NULL);
+    put_word((sf ? 0x93401c00 : 0x13001c00) | (rn << 5) | rd);
+    return;
+  }
+
+  bad_line();
+}
+
+// ディレクティブを処理する
+void assemble_directive(char *name, char *args) {
+  if (!strcmp(name, ".text")) {
+    cur_sec = SEC_TEXT;
+    return;
+  }
+  if (!strcmp(name, ".data")) {
+    cur_sec = SEC_DATA;
+    return;
+  }
+  if (!strcmp(name, ".bss")) {
+    cur_sec = SEC_BSS;
+    return;
+  }
+  if (!strcmp(name, ".section")) {
+    for (int i = 0; i < NUM_SECS; i++) {
+      if (!strcmp(args, sec_names[i])) {
+        cur_sec = i;
+        return;
+      }
+    }
+    bad_line();
+  }
+  if (!strcmp(name, ".globl")) {
+    globals = realloc(globals, (num_globals + 1) * sizeof(char *));
+    globals[num_globals++] = args;
+    return;
+  }
+  if (!strcmp(name, ".p2align")) {
+    int align = 1 << atoi(args);
+    if (cur_buf()->align < align)
+      cur_buf()->align = align;
+    while (cur_buf()->len % align)
+      put_byte(0);
+    return;
+  }
+  if (!strcmp(name, ".byte")) {
+    put_byte(atoi(args));
+    return;
+  }
+  if (!strcmp(name, ".zero")) {
+    for (int i = atoi(args); i > 0; i--)
+      put_byte(0);
+    return;
+  }
+  if (!strcmp(name, ".word")) {
+    // ジャンプテーブルの要素 (A - B)
+    char *minus = strstr(args, " - ");
+    if (!minus)
+      bad_line();
+    *minus = '\0';
+    mark_mapping(true);
+    add_fixup(FX_DIFF32, strip(args), 0, 0);
+    fixups->base = strip(minus + 3);
+    put_word(0);
+    return;
+  }
+  bad_line();
+}
+
+// アセンブリ1行を機械語に変換する
+void assemble_line(char *text) {
+  cur_line = text;
+  char *line = strip(duplicate_string_n(text, strlen(text)));
+  int len = strlen(line);
+  if (!len)
+    return;
+
+  // ラベル
+  if (line[len - 1] == ':') {
+    line[len - 1] = '\0';
+    add_label(line);
+    return;
+  }
+
+  char *args = line + len;
+  char *sp = strpbrk(line, " \t");
+  if (sp) {
+    *sp = '\0';
+    args = strip(sp + 1);
+  }
+
+  if (*line == '.') {
+    assemble_directive(line, args);
+    return;
+  }
+
+  // 角括弧の外のカンマでオペランドを区切る
+  char *ops[5];
+  int n = 0;
+  if (*args) {
+    int depth = 0;
+    ops[n++] = args;
+    for (char *p = args; *p; p++) {
+      if (*p == '[')
+        depth++;
+      else if (*p == ']')
+        depth--;
+      else if (*p == ',' && depth == 0) {
+        if (n == 5)
+          bad_line();
+        *p = '\0';
+        ops[n++] = p + 1;
+      }
+    }
+    for (int i = 0; i < n; i++)
+      ops[i] = strip(ops[i]);
+  }
+  mark_mapping(false);
+  assemble_insn(line, ops, n);
+}
+
+//
+// 参照の解決とELFの出力
+//
+
+// PC相対の参照を命令に埋め込む。範囲外ならエラー
+void patch_pc_rel(Fixup *fx, Label *l) {
+  unsigned char *loc = secs[fx->sec].buf + fx->offset;
+  unsigned int insn;
+  memcpy(&insn, loc, 4);
+  long disp = l->offset + fx->addend - fx->offset;
+
+  switch (fx->kind) {
+  case FX_JUMP26:
+    if (disp % 4 || disp < -(1L << 27) || disp >= (1L << 27))
+      error("分岐先が遠すぎます: %s", fx->name);
+    insn |= (disp >> 2) & 0x3ffffff;
+    break;
+  case FX_COND19:
+    if (disp % 4 || disp < -(1L << 20) || disp >= (1L << 20))
+      error("分岐先が遠すぎます: %s", fx->name);
+    insn |= ((disp >> 2) & 0x7ffff) << 5;
+    break;
+  case FX_ADR21:
+    if (disp < -(1L << 20) || disp >= (1L << 20))
+      error("adrの参照先が遠すぎます: %s", fx->name);
+    insn |= ((disp & 3) << 29) | (((disp >> 2) & 0x7ffff) << 5);
+    break;
+  default:
+    break;
+  }
+  memcpy(loc, &insn, 4);
+}
+
+void add_reloc(Fixup *fx) {
+  if (fx->sec != SEC_TEXT)
+    error("text以外のリロケーションには対応していません: %s", fx->name);
+  Reloc *r = calloc(1, sizeof(Reloc));
+  r->offset = fx->offset;
+  r->name = fx->name;
+  r->addend = fx->addend;
+  r->type = fx->type;
+  r->next = relocs;
+  relocs = r;
+}
+
+void resolve_fixups(void) {
+  for (Fixup *fx = fixups; fx; fx = fx->next) {
+    Label *l = find_label(fx->name);
+    switch (fx->kind) {
+    case FX_JUMP26:
+      // ファイル内のtextにある分岐先はここで解決する
+      if (l && l->sec == fx->sec) {
+        patch_pc_rel(fx, l);
+        continue;
+      }
+      add_reloc(fx);
+      continue;
+    case FX_COND19:
+    case FX_ADR21:
+      if (!l || l->sec != fx->sec)
+        error("未定義のラベルです: %s", fx->name);
+      patch_pc_rel(fx, l);
+      continue;
+    case FX_DIFF32: {
+      Label *base = find_label(fx->base);
+      if (!l || !base || l->sec != base->sec)
+        error("ラベルの差を計算できません: %s - %s", fx->name, fx->base);
+      int val = l->offset - base->offset;
+      memcpy(secs[fx->sec].buf + fx->offset, &val, 4);
+      continue;
+    }
+    case FX_RELOC:
+      add_reloc(fx);
+      continue;
+    }
+  }
+}
+
+// 文字列テーブル
+typedef struct {
+  char *buf;
+  int len;
+} StrTab;
+
+int add_str(StrTab *tab, char *s) {
+  int off = tab->len;
+  int n = strlen(s) + 1;
+  tab->buf = realloc(tab->buf, tab->len + n);
+  memcpy(tab->buf + tab->len, s, n);
+  tab->len += n;
+  return off;
+}
+
+// ELFのセクションヘッダの番号
+enum {
+  SHN_TEXT = 1,
+  SHN_DATA,
+  SHN_RODATA,
+  SHN_BSS,
+  SHN_RELA_TEXT,
+  SHN_SYMTAB,
+  SHN_STRTAB,
+  SHN_SHSTRTAB,
+  SHN_NOTE_STACK,
+  NUM_SHDRS,
+};
+
+// ファイルの位置をalignの倍数に揃える
+long pad_to(FILE *fp, int align) {
+  long pos = ftell(fp);
+  while (pos % align) {
+    fputc(0, fp);
+    pos++;
+  }
+  return pos;
+}
+
+void write_elf(char *path) {
+  // シンボル: 0番は空、次に各セクションのシンボルとマッピングシンボル
+  // (ローカル)、その後にグローバルなシンボル (定義されたものと未定義のもの)
+  StrTab strtab = {0};
+  add_str(&strtab, "");
+  int map_x = add_str(&strtab, "$x");
+  int map_d = add_str(&strtab, "$d");
+  int nsyms = 1 + NUM_SECS;
+  for (Mapping *m = mappings; m; m = m->next)
+    nsyms++;
+  Elf64_Sym *syms = calloc(nsyms, sizeof(Elf64_Sym));
+  for (int i = 0; i < NUM_SECS; i++) {
+    syms[1 + i].st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+    syms[1 + i].st_shndx = SHN_TEXT + i;
+  }
+  Elf64_Sym *sym = &syms[1 + NUM_SECS];
+  for (Mapping *m = mappings; m; m = m->next, sym++) {
+    sym->st_name = m->is_data ? map_d : map_x;
+    sym->st_info = ELF64_ST_INFO(STB_LOCAL, STT_NOTYPE);
+    sym->st_shndx = SHN_TEXT;
+    sym->st_value = m->offset;
+  }
+  int first_global = nsyms;
+
+  for (int i = 0; i < num_globals; i++) {
+    Label *l = find_label(globals[i]);
+    if (!l || is_local_label(l->name) || l->sym)
+      continue;
+    syms = realloc(syms, (nsyms + 1) * sizeof(Elf64_Sym));
+    Elf64_Sym *sym = &syms[nsyms];
+    memset(sym, 0, sizeof(*sym));
+    sym->st_name = add_str(&strtab, l->name);
+    int type = l->sec == SEC_TEXT ? STT_FUNC : STT_OBJECT;
+    sym->st_info = ELF64_ST_INFO(STB_GLOBAL, type);
+    sym->st_shndx = SHN_TEXT + l->sec;
+    sym->st_value = l->offset;
+    l->sym = nsyms++;
+  }
+
+  // リロケーション。ファイル内のローカルなラベルはセクションのシンボルからの
+  // オフセットで表し、それ以外はグローバルなシンボルを参照する
+  int nrelas = 0;
+  for (Reloc *r = relocs; r; r = r->next)
+    nrelas++;
+  Elf64_Rela *relas = calloc(nrelas + 1, sizeof(Elf64_Rela));
+  int i = nrelas;
+  for (Reloc *r = relocs; r; r = r->next) {
+    Elf64_Rela *rela = &relas[--i];
+    Label *l = find_label(r->name);
+    int sym;
+    long addend = r->addend;
+    if (l && !l->sym) {
+      if (!is_local_label(l->name) && !is_global(l->name))
+        error("ローカルなシンボルへの参照です: %s", l->name);
+      sym = 1 + l->sec;
+      addend += l->offset;
+    } else if (l) {
+      sym = l->sym;
+    } else {
+      // 未定義のシンボル (リンク時にライブラリなどから解決する)
+      if (is_local_label(r->name))
+        error("未定義のラベルです: %s", r->name);
+      Label *undef = calloc(1, sizeof(Label));
+      undef->name = r->name;
+      undef->sec = NUM_SECS;
+      undef->next = labels[hash(r->name)];
+      labels[hash(r->name)] = undef;
+
+      syms = realloc(syms, (nsyms + 1) * sizeof(Elf64_Sym));
+      memset(&syms[nsyms], 0, sizeof(Elf64_Sym));
+      syms[nsyms].st_name = add_str(&strtab, r->name);
+      syms[nsyms].st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+      syms[nsyms].st_shndx = SHN_UNDEF;
+      undef->sym = sym = nsyms++;
+    }
+    rela->r_offset = r->offset;
+    rela->r_info = ELF64_R_INFO(sym, r->type);
+    rela->r_addend = addend;
+  }
+
+  StrTab shstrtab = {0};
+  add_str(&shstrtab, "");
+  Elf64_Shdr shdrs[NUM_SHDRS] = {0};
+
+  FILE *fp = fopen(path, "wb");
+  if (!fp)
+    error("ファイルを開けません %s: %s", path, strerror(errno));
+
+  Elf64_Ehdr ehdr = {0};
+  memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+  ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+  ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+  ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+  ehdr.e_ident[EI_OSABI] = ELFOSABI_NONE;
+  ehdr.e_type = ET_REL;
+  ehdr.e_machine = EM_AARCH64;
+  ehdr.e_version = EV_CURRENT;
+  ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+  ehdr.e_shentsize = sizeof(Elf64_Shdr);
+  ehdr.e_shnum = NUM_SHDRS;
+  ehdr.e_shstrndx = SHN_SHSTRTAB;
+  fwrite(&ehdr, sizeof(ehdr), 1, fp);
+
+  // 中身を持つセクション
+  int flags[] = {SHF_ALLOC | SHF_EXECINSTR, SHF_ALLOC | SHF_WRITE, SHF_ALLOC,
+                 SHF_ALLOC | SHF_WRITE};
+  for (int i = 0; i < NUM_SECS; i++) {
+    Buffer *buf = &secs[i];
+    Elf64_Shdr *sh = &shdrs[SHN_TEXT + i];
+    int align = buf->align ? buf->align : (i == SEC_TEXT ? 4 : 1);
+    sh->sh_name = add_str(&shstrtab, sec_names[i]);
+    sh->sh_type = i == SEC_BSS ? SHT_NOBITS : SHT_PROGBITS;
+    sh->sh_flags = flags[i];
+    sh->sh_addralign = align;
+    sh->sh_size = buf->len;
+    sh->sh_offset = pad_to(fp, align);
+    if (i != SEC_BSS)
+      fwrite(buf->buf, 1, buf->len, fp);
+  }
+
+  Elf64_Shdr *sh = &shdrs[SHN_RELA_TEXT];
+  sh->sh_name = add_str(&shstrtab, ".rela.text");
+  sh->sh_type = SHT_RELA;
+  sh->sh_flags = SHF_INFO_LINK;
+  sh->sh_link = SHN_SYMTAB;
+  sh->sh_info = SHN_TEXT;
+  sh->sh_addralign = 8;
+  sh->sh_entsize = sizeof(Elf64_Rela);
+  sh->sh_size = nrelas * sizeof(Elf64_Rela);
+  sh->sh_offset = pad_to(fp, 8);
+  fwrite(relas, sizeof(Elf64_Rela), nrelas, fp);
+
+  sh = &shdrs[SHN_SYMTAB];
+  sh->sh_name = add_str(&shstrtab, ".symtab");
+  sh->sh_type = SHT_SYMTAB;
+  sh->sh_link = SHN_STRTAB;
+  sh->sh_info = first_global;
+  sh->sh_addralign = 8;
+  sh->sh_entsize = sizeof(Elf64_Sym);
+  sh->sh_size = nsyms * sizeof(Elf64_Sym);
+  sh->sh_offset = pad_to(fp, 8);
+  fwrite(syms, sizeof(Elf64_Sym), nsyms, fp);
+
+  sh = &shdrs[SHN_STRTAB];
+  sh->sh_name = add_str(&shstrtab, ".strtab");
+  sh->sh_type = SHT_STRTAB;
+  sh->sh_addralign = 1;
+  sh->sh_size = strtab.len;
+  sh->sh_offset = ftell(fp);
+  fwrite(strtab.buf, 1, strtab.len, fp);
+
+  // 実行可能なスタックを要求しないことをリンカに伝える
+  sh = &shdrs[SHN_NOTE_STACK];
+  sh->sh_name = add_str(&shstrtab, ".note.GNU-stack");
+  sh->sh_type = SHT_PROGBITS;
+  sh->sh_addralign = 1;
+  sh->sh_offset = ftell(fp);
+
+  sh = &shdrs[SHN_SHSTRTAB];
+  sh->sh_name = add_str(&shstrtab, ".shstrtab");
+  sh->sh_type = SHT_STRTAB;
+  sh->sh_addralign = 1;
+  sh->sh_size = shstrtab.len;
+  sh->sh_offset = ftell(fp);
+  fwrite(shstrtab.buf, 1, shstrtab.len, fp);
+
+  ehdr.e_shoff = pad_to(fp, 8);
+  fwrite(shdrs, sizeof(Elf64_Shdr), NUM_SHDRS, fp);
+
+  // セクションヘッダの位置を書き戻す
+  fseek(fp, 0, SEEK_SET);
+  fwrite(&ehdr, sizeof(ehdr), 1, fp);
+  fclose(fp);
+}
+
+// プログラムをARM64の機械語にして、ELFのオブジェクトファイルpathに書き出す
+void write_object(Program *prog, char *path) {
+  // 前の翻訳単位の状態を捨てる (-jでは1つのスレッドが複数のファイルを扱う)
+  memset(secs, 0, sizeof(secs));
+  memset(labels, 0, sizeof(labels));
+  cur_sec = SEC_TEXT;
+  fixups = NULL;
+  relocs = NULL;
+  globals = NULL;
+  num_globals = 0;
+  mappings = NULL;
+
+  for (Insn *insn = emit_arm64(prog); insn; insn = insn->next)
+    assemble_line(insn->text);
+  resolve_fixups();
+  write_elf(path);
+}
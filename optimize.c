@@ -0,0 +1,401 @@
+#include "he3cc.h"
+
+// ループ展開の設定 (コマンドラインオプションで変更できる)
+int unroll_factor = 4;  // 部分展開で並べる本体の数 (1なら部分展開しない)
+int unroll_budget = 64; // 展開後の本体の大きさの上限 (ノード数)
+
+// 最適化中の関数
+_Thread_local Function *current_fn;
+
+// 条件に関わらず先に評価してしまってよい、副作用がなく安価な式かどうか。
+// 定数・変数・変数のアドレスと、それらどうしの加減乗算に限る。
+// これらの評価はフラグを書き換えないので、比較の後に評価できる
+bool is_speculatable(Node *node) {
+  switch (node->kind) {
+  case ND_NUM:
+  case ND_VAR:
+    return true;
+  case ND_ADDR:
+    return node->lhs->kind == ND_VAR;
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL: {
+    Node *lhs = node->lhs;
+    Node *rhs = node->rhs;
+    return (lhs->kind == ND_NUM || lhs->kind == ND_VAR) &&
+           (rhs->kind == ND_NUM || rhs->kind == ND_VAR);
+  }
+  default:
+    return false;
+  }
+}
+
+// 文が1つだけのブロックを、その文自体に置き換える
+Node *unwrap_block(Node *node) {
+  while (node && node->kind == ND_BLOCK && node->body && !node->body->next)
+    node = node->body;
+  return node;
+}
+
+// 文nodeが「変数 = 先行評価できる式;」なら、その代入ノードを返す
+Node *simple_assign(Node *node) {
+  node = unwrap_block(node);
+  if (!node || node->kind != ND_EXPR_STMT)
+    return NULL;
+
+  Node *assign = node->lhs;
+  if (assign->kind != ND_ASSIGN || assign->lhs->kind != ND_VAR ||
+      assign->lhs->ty->kind == TY_ARRAY || !is_speculatable(assign->rhs))
+    return NULL;
+  return assign;
+}
+
+// if変換:
+//   if (c) x = a; else x = b;  ->  x = c ? a : b;
+//   if (c) x = a;              ->  x = c ? a : x;
+// a, bが先行評価できれば、?: はコード生成でcselになり分岐がなくなる
+void if_convert(Node *node) {
+  Node *then = simple_assign(node->then);
+  if (!then)
+    return;
+
+  Node *els;
+  if (node->els) {
+    Node *assign = simple_assign(node->els);
+    if (!assign || assign->lhs->var != then->lhs->var)
+      return;
+    els = assign->rhs;
+  } else {
+    els = then->lhs;
+  }
+
+  Node *cond = new_node(ND_COND, node->tok);
+  cond->cond = node->cond;
+  cond->then = then->rhs;
+  cond->els = els;
+  cond->ty = then->lhs->ty;
+
+  Node *assign = new_node_binary_op(ND_ASSIGN, then->lhs, cond, node->tok);
+
+  // ノードを書き換えて、文のリストのつながり (next) を保つ。
+  // 式文の欄はif文の欄と重なっているので、欄を消してから書き込む
+  node->cond = node->then = node->els = NULL;
+  node->kind = ND_EXPR_STMT;
+  node->lhs = assign;
+}
+
+// 計数ループ
+//   for (i = start; i < limit; i += step) body
+// (<=ならinclusive)
+typedef struct {
+  Var *var;       // 誘導変数
+  long start;     // 初期値
+  long step;      // 増分 (正の定数)
+  Node *limit;    // 上限 (定数またはループ中で変わらない変数)
+  bool inclusive; // 条件が <= かどうか
+} CountedLoop;
+
+// 構文木の大きさ (ノード数)
+int node_count(Node *node) {
+  if (!node)
+    return 0;
+  int n = 1;
+  Node **slots[MAX_CHILDREN];
+  int nslots = child_slots(node, slots);
+  for (int i = 0; i < nslots; i++)
+    for (Node *c = *slots[i]; c; c = c->next)
+      n += node_count(c);
+  return n;
+}
+
+// 構文木の中でvarのアドレスが取られているか
+bool is_addr_taken(Node *node, Var *var) {
+  if (!node)
+    return false;
+  if (node->kind == ND_ADDR && node->lhs->kind == ND_VAR &&
+      node->lhs->var == var)
+    return true;
+  Node **slots[MAX_CHILDREN];
+  int nslots = child_slots(node, slots);
+  for (int i = 0; i < nslots; i++)
+    for (Node *c = *slots[i]; c; c = c->next)
+      if (is_addr_taken(c, var))
+        return true;
+  return false;
+}
+
+// 関数の中でローカル変数varが直接の代入以外で書き換わる可能性があるか
+bool may_alias(Var *var) {
+  if (!var->is_local)
+    return true;
+  for (Node *n = current_fn->node; n; n = n->next)
+    if (is_addr_taken(n, var))
+      return true;
+  return false;
+}
+
+// 代入・複合代入・後置++/--の左辺がvarかどうか
+bool assigns_var(Node *node, Var *var) {
+  switch (node->kind) {
+  case ND_ASSIGN:
+  case ND_ADD_ASSIGN:
+  case ND_SUB_ASSIGN:
+  case ND_MUL_ASSIGN:
+  case ND_DIV_ASSIGN:
+  case ND_POST_INC:
+  case ND_POST_DEC:
+    return node->lhs->kind == ND_VAR && node->lhs->var == var;
+  default:
+    return false;
+  }
+}
+
+// ループ本体nodeを複製してよいか。
+// 誘導変数と上限の変数を書き換えず、このループを抜けるbreakを含まないこと。
+// switch文はcaseのリストを複製できないので含まないこと
+bool is_unrollable_body(Node *node, CountedLoop *loop, bool in_loop) {
+  if (!node)
+    return true;
+
+  switch (node->kind) {
+  case ND_SWITCH:
+  case ND_CASE:
+    return false;
+  case ND_BREAK:
+    return in_loop;
+  case ND_WHILE:
+  case ND_FOR:
+    in_loop = true;
+    break;
+  default:
+    break;
+  }
+
+  if (assigns_var(node, loop->var))
+    return false;
+  if (loop->limit->kind == ND_VAR && assigns_var(node, loop->limit->var))
+    return false;
+
+  Node **slots[MAX_CHILDREN];
+  int nslots = child_slots(node, slots);
+  for (int i = 0; i < nslots; i++)
+    for (Node *c = *slots[i]; c; c = c->next)
+      if (!is_unrollable_body(c, loop, in_loop))
+        return false;
+  return true;
+}
+
+// 増分式nodeが誘導変数varを正の定数だけ増やすなら、その増分を返す。
+// そうでなければ0を返す
+long induction_step(Node *node, Var *var) {
+  if (!assigns_var(node, var))
+    return 0;
+
+  // i++, ++i, i += k
+  if (node->kind == ND_POST_INC || node->kind == ND_ADD_ASSIGN)
+    return node->rhs->kind == ND_NUM && node->rhs->val > 0 ? node->rhs->val
+                                                          : 0;
+
+  // i = i + k
+  Node *rhs = node->rhs;
+  if (node->kind == ND_ASSIGN && rhs->kind == ND_ADD &&
+      rhs->lhs->kind == ND_VAR && rhs->lhs->var == var &&
+      rhs->rhs->kind == ND_NUM && rhs->rhs->val > 0)
+    return rhs->rhs->val;
+  return 0;
+}
+
+// for文nodeが計数ループかどうかを判定し、その形をloopに格納する
+bool match_counted_loop(Node *node, CountedLoop *loop) {
+  if (!node->init || !node->cond || !node->inc)
+    return false;
+
+  // 初期化: i = 定数
+  Node *init = node->init->lhs;
+  if (init->kind != ND_ASSIGN || init->lhs->kind != ND_VAR ||
+      init->rhs->kind != ND_NUM)
+    return false;
+  Var *var = init->lhs->var;
+  if (var->ty->kind != TY_INT || may_alias(var))
+    return false;
+
+  // 条件: i < 上限 または i <= 上限
+  Node *cond = node->cond;
+  if ((cond->kind != ND_LT && cond->kind != ND_LE) ||
+      cond->lhs->kind != ND_VAR || cond->lhs->var != var)
+    return false;
+  Node *limit = cond->rhs;
+  if (limit->kind == ND_VAR) {
+    if (limit->var == var || limit->var->ty->kind != TY_INT ||
+        may_alias(limit->var))
+      return false;
+  } else if (limit->kind != ND_NUM) {
+    return false;
+  }
+
+  // 増分: 正の定数
+  long step = induction_step(node->inc->lhs, var);
+  if (step <= 0)
+    return false;
+
+  loop->var = var;
+  loop->start = init->rhs->val;
+  loop->step = step;
+  loop->limit = limit;
+  loop->inclusive = cond->kind == ND_LE;
+  return is_unrollable_body(node->then, loop, false);
+}
+
+// 構文木nodeを複製する。substなら誘導変数varの参照を定数valに置き換える
+Node *copy_node(Node *node, Var *var, long val, bool subst) {
+  if (!node)
+    return NULL;
+
+  if (subst && node->kind == ND_VAR && node->var == var) {
+    Node *n = new_node(ND_NUM, node->tok);
+    n->ty = node->ty;
+    n->val = val;
+    return n;
+  }
+
+  Node *n = clone_node(node);
+  n->next = NULL;
+
+  Node **slots[MAX_CHILDREN];
+  int nslots = child_slots(n, slots);
+  for (int i = 0; i < nslots; i++) {
+    Node head = {0};
+    Node *cur = &head;
+    for (Node *c = *slots[i]; c; c = c->next)
+      cur = cur->next = copy_node(c, var, val, subst);
+    *slots[i] = head.next;
+  }
+  return n;
+}
+
+// 「var = val;」の文を作る
+Node *new_assign_stmt(Node *var, long val, Token *tok) {
+  Node *num = new_node(ND_NUM, tok);
+  num->val = val;
+  num->ty = var->ty;
+  Node *assign = new_node_binary_op(ND_ASSIGN, var, num, tok);
+  Node *stmt = new_node(ND_EXPR_STMT, tok);
+  stmt->lhs = assign;
+  return stmt;
+}
+
+// 上限が定数のループを完全に展開した文のリストを返す。
+// 各本体の誘導変数は定数に置き換える。予算に収まらなければNULLを返す
+Node *full_unroll(Node *node, CountedLoop *loop, int size) {
+  if (loop->limit->kind != ND_NUM)
+    return NULL;
+
+  long end = loop->limit->val + (loop->inclusive ? 1 : 0);
+  long trips = 0;
+  if (end > loop->start)
+    trips = (end - loop->start + loop->step - 1) / loop->step;
+  if (trips * size > unroll_budget)
+    return NULL;
+
+  Node head = {0};
+  Node *cur = &head;
+  for (long i = 0; i < trips; i++)
+    cur = cur->next =
+        copy_node(node->then, loop->var, loop->start + i * loop->step, true);
+
+  // ループを抜けた後の誘導変数の値
+  Node *var = node->init->lhs->lhs;
+  cur->next = new_assign_stmt(var, loop->start + trips * loop->step, node->tok);
+  return head.next;
+}
+
+// unroll_factor個の本体を並べたループと、残りの回数を回すループに分けた
+// 文のリストを返す:
+//   i = start;
+//   for (; i + (F-1)*step < limit;) { body; inc; ... (F回) }
+//   for (; i < limit; inc) body
+// 予算に収まらなければNULLを返す
+Node *partial_unroll(Node *node, CountedLoop *loop, int size) {
+  int factor = unroll_factor;
+  while (factor > 1 && factor * size > unroll_budget)
+    factor--;
+  if (factor < 2)
+    return NULL;
+
+  Token *tok = node->tok;
+  Node *var = node->init->lhs->lhs;
+  Node *ahead = new_node(ND_NUM, tok);
+  ahead->val = (factor - 1) * loop->step;
+  ahead->ty = var->ty;
+  Node *sum = new_node_binary_op(ND_ADD, var, ahead, tok);
+
+  Node *unrolled = new_node(ND_FOR, tok);
+  unrolled->cond = new_node_binary_op(node->cond->kind, sum, loop->limit, tok);
+  unrolled->then = new_node(ND_BLOCK, tok);
+
+  Node head = {0};
+  Node *cur = &head;
+  for (int i = 0; i < factor; i++) {
+    cur = cur->next = copy_node(node->then, NULL, 0, false);
+    cur = cur->next = copy_node(node->inc, NULL, 0, false);
+  }
+  unrolled->then->body = head.next;
+
+  Node *rest = new_node(ND_FOR, tok);
+  rest->cond = node->cond;
+  rest->inc = node->inc;
+  rest->then = node->then;
+
+  node->init->next = unrolled;
+  unrolled->next = rest;
+  return node->init;
+}
+
+// 計数ループを展開する。上限が定数で予算に収まれば完全に展開し、
+// そうでなければ部分的に展開する
+void unroll_loop(Node *node) {
+  CountedLoop loop;
+  if (!match_counted_loop(node, &loop))
+    return;
+
+  int size = node_count(node->then) + node_count(node->inc);
+  Node *stmts = full_unroll(node, &loop, size);
+  if (!stmts)
+    stmts = partial_unroll(node, &loop, size);
+  if (!stmts)
+    return;
+
+  // ノードを書き換えて、文のリストのつながり (next) を保つ。
+  // ブロックの欄はfor文の欄と重なっているので、欄を消してから書き込む
+  node->init = node->cond = node->inc = node->then = NULL;
+  node->kind = ND_BLOCK;
+  node->body = stmts;
+}
+
+void optimize_node(Node *node) {
+  if (!node)
+    return;
+
+  Node **slots[MAX_CHILDREN];
+  int nslots = child_slots(node, slots);
+  for (int i = 0; i < nslots; i++)
+    for (Node *n = *slots[i]; n; n = n->next)
+      optimize_node(n);
+
+  if (node->kind == ND_IF)
+    if_convert(node);
+  if (node->kind == ND_FOR)
+    unroll_loop(node);
+}
+
+// 型付け済みの構文木を書き換えて最適化する
+void optimize(Program *prog) {
+  for (Function *fn = prog->fns; fn; fn = fn->next) {
+    // キャッシュから読み込んだ関数はコードを生成しないので最適化しない
+    if (fn->cached)
+      continue;
+    current_fn = fn;
+    for (Node *node = fn->node; node; node = node->next)
+      optimize_node(node);
+  }
+}
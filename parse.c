@@ -1,18 +1,40 @@
 #include "he3cc.h"
 
+#include <stddef.h>
+
 // local_vars: 関数内の全ローカル変数
 //             スタックサイズ計算・オフセット割り当てに使う
 //             ブロックを抜けても変数は残る（メモリは確保したまま）
-VarList *local_vars;
+_Thread_local VarList *local_vars;
 
 // global_vars: 全グローバル変数
 //              .data セクションに出力される
-VarList *global_vars;
+_Thread_local VarList *global_vars;
 
 // scope_vars: 現在のスコープで「見える」変数
 //             find_var() での名前解決に使う
 //             ブロックを抜けると復元される（シャドウイング対応）
-VarList *scope_vars;
+_Thread_local VarList *scope_vars;
+
+// 現在解析中のswitch文
+_Thread_local Node *current_switch;
+
+// 現在のスコープの通し番号と、これまでに作ったスコープの数
+_Thread_local int scope_id;
+_Thread_local int scope_count;
+
+// 現在解析中の関数の名前 (関数の外ではNULL)
+_Thread_local char *current_fn_name;
+
+// 文字列リテラルに付けた匿名ラベルの数 (関数の中では関数ごとに数える)
+_Thread_local int label_count;
+
+// 新しいスコープに入り、元のスコープの番号を返す
+int enter_scope() {
+  int sc = scope_id;
+  scope_id = ++scope_count;
+  return sc;
+}
 
 // 既存の変数を名前で検索する関数
 Var *find_var(Token *tok) {
@@ -26,19 +48,138 @@ Var *find_var(Token *tok) {
   return NULL;
 }
 
+// 欄memberで終わるノードの大きさ
+#define NODE_SIZE_TO(member)                                                   \
+  (offsetof(Node, member) + sizeof(((Node *)0)->member))
+
+// 種類kindのノードに確保する大きさ。使う欄の最後までを確保する
+int node_size(NodeKind kind) {
+  switch (kind) {
+  case ND_VAR:
+    return NODE_SIZE_TO(var);
+  case ND_NUM:
+  case ND_BREAK:
+  case ND_NULL:
+    return NODE_SIZE_TO(tok);
+  case ND_NOT:
+  case ND_ADDR:
+  case ND_DEREF:
+  case ND_RETURN:
+  case ND_EXPR_STMT:
+    return NODE_SIZE_TO(lhs);
+  case ND_CASE:
+    return NODE_SIZE_TO(case_label);
+  case ND_SWITCH:
+    return NODE_SIZE_TO(default_case);
+  case ND_WHILE:
+    return NODE_SIZE_TO(then);
+  case ND_IF:
+  case ND_COND:
+    return NODE_SIZE_TO(els);
+  case ND_FOR:
+    return NODE_SIZE_TO(inc);
+  case ND_FUN_CALL:
+    return NODE_SIZE_TO(args);
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    return NODE_SIZE_TO(body);
+  default:
+    return NODE_SIZE_TO(rhs);
+  }
+}
+
+// ノード用のメモリ領域 (アリーナ)
+// 大きなブロックを確保して先頭から切り出していく。ノードは解放しない
+#define NODE_ARENA_BLOCK (64 * 1024)
+
+_Thread_local char *node_arena;
+_Thread_local int node_arena_used;
+
+// ノード用に0で初期化したsizeバイトを確保する
+Node *alloc_node(int size) {
+  size = align_to(size, sizeof(void *));
+  if (!node_arena || node_arena_used + size > NODE_ARENA_BLOCK) {
+    node_arena = calloc(1, NODE_ARENA_BLOCK);
+    node_arena_used = 0;
+  }
+  Node *node = (Node *)(node_arena + node_arena_used);
+  node_arena_used += size;
+  return node;
+}
+
 // 新しいノードを生成する関数
 Node *new_node(NodeKind kind, Token *tok) {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = alloc_node(node_size(kind));
   node->kind = kind;
   node->tok = tok;
   return node;
 }
 
+// ノードを1つ複製する (子ノードは元のノードと共有する)
+Node *clone_node(Node *node) {
+  int size = node_size(node->kind);
+  Node *n = alloc_node(size);
+  memcpy(n, node, size);
+  return n;
+}
+
+// ノードの種類ごとに、使っている子ノードの欄のアドレスをslotsに並べ、
+// その数を返す。欄の値はnextでつながったリストの先頭で、NULLのこともある
+// (body, args以外は1つのノードだけを指す)
+int child_slots(Node *node, Node **slots[MAX_CHILDREN]) {
+  int n = 0;
+  switch (node->kind) {
+  case ND_VAR:
+  case ND_NUM:
+  case ND_BREAK:
+  case ND_NULL:
+    break;
+  case ND_NOT:
+  case ND_ADDR:
+  case ND_DEREF:
+  case ND_RETURN:
+  case ND_EXPR_STMT:
+  case ND_CASE:
+    slots[n++] = &node->lhs;
+    break;
+  case ND_IF:
+  case ND_COND:
+    slots[n++] = &node->cond;
+    slots[n++] = &node->then;
+    slots[n++] = &node->els;
+    break;
+  case ND_WHILE:
+  case ND_SWITCH:
+    slots[n++] = &node->cond;
+    slots[n++] = &node->then;
+    break;
+  case ND_FOR:
+    slots[n++] = &node->init;
+    slots[n++] = &node->cond;
+    slots[n++] = &node->inc;
+    slots[n++] = &node->then;
+    break;
+  case ND_FUN_CALL:
+    slots[n++] = &node->args;
+    break;
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    slots[n++] = &node->body;
+    break;
+  default:
+    slots[n++] = &node->lhs;
+    slots[n++] = &node->rhs;
+    break;
+  }
+  return n;
+}
+
 // 二項演算子ノードを生成する関数
 Node *new_node_binary_op(NodeKind kind, Node *lhs, Node *rhs, Token *tok) {
   Node *node = new_node(kind, tok);
   node->lhs = lhs;
   node->rhs = rhs;
+  add_type(node);
   return node;
 }
 
@@ -46,6 +187,7 @@ Node *new_node_binary_op(NodeKind kind, Node *lhs, Node *rhs, Token *tok) {
 Node *new_node_unary_op(NodeKind kind, Node *operand, Token *tok) {
   Node *node = new_node(kind, tok);
   node->lhs = operand;
+  add_type(node);
   return node;
 }
 
@@ -53,6 +195,7 @@ Node *new_node_unary_op(NodeKind kind, Node *operand, Token *tok) {
 Node *new_node_num(int val, Token *tok) {
   Node *node = new_node(ND_NUM, tok);
   node->val = val;
+  add_type(node);
   return node;
 }
 
@@ -60,6 +203,7 @@ Node *new_node_num(int val, Token *tok) {
 Node *new_var(Var *var, Token *tok) {
   Node *node = new_node(ND_VAR, tok);
   node->var = var;
+  add_type(node);
   return node;
 }
 
@@ -69,6 +213,7 @@ Var *push_var(char *name, Type *ty, bool is_local) {
   var->name = name;
   var->ty = ty;
   var->is_local = is_local;
+  var->scope = scope_id;
 
   VarList *var_list = calloc(1, sizeof(VarList));
   var_list->var = var;
@@ -89,11 +234,15 @@ Var *push_var(char *name, Type *ty, bool is_local) {
 }
 
 // 新しい匿名ラベルを生成する関数
+// 関数の中のラベルには関数名を含める。他の関数を書き換えても番号が
+// ずれないので、関数ごとのコードをキャッシュから再利用できる
 char *new_label() {
-  static int cnt = 0;
-  char buf[20];
-  sprintf(buf, "data.%d", cnt++);
-  return duplicate_string_n(buf, 20);
+  char buf[256];
+  if (current_fn_name)
+    snprintf(buf, sizeof(buf), "data.%s.%d", current_fn_name, label_count++);
+  else
+    snprintf(buf, sizeof(buf), "data.%d", label_count++);
+  return duplicate_string_n(buf, strlen(buf));
 }
 
 // トップレベル
@@ -115,27 +264,17 @@ Node *declaration();
 
 // 式
 Node *expr();
-Node *assign();
-Node *equality();
-Node *relational();
-Node *add();
-Node *mul();
-Node *unary();
-Node *postfix();
 Node *primary();
 
 // GNU拡張の式文
 Node *stmt_expr();
 
-// 関数呼び出し引数
-Node *func_args();
-
 // 先読み: 関数定義かどうか
 bool peek_is_function() {
-  Token *saved = token;
+  int saved = token_pos;
   basetype();
   bool result = consume_ident() && consume("(");
-  token = saved;
+  token_pos = saved;
   return result;
 }
 
@@ -145,6 +284,7 @@ Program *program() {
   head.next = NULL;
   Function *cur = &head;
   global_vars = NULL;
+  scope_id = scope_count = label_count = 0;
 
   while (!at_eof()) {
     if (peek_is_function()) {
@@ -174,12 +314,18 @@ void global_var() {
 // function = basetype ident "(" func-params? ")" "{" stmt* "}"
 Function *function() {
   local_vars = NULL;
+  enter_scope();
 
   Function *fn = calloc(1, sizeof(Function));
+  fn->src = tokens[token_pos].str;
   basetype();
   fn->name = expect_ident();
   expect("(");
 
+  int global_label_count = label_count;
+  current_fn_name = fn->name;
+  label_count = 0;
+
   fn->params = func_params();
   expect("{");
 
@@ -187,11 +333,19 @@ Function *function() {
   head.next = NULL;
   Node *cur = &head;
 
-  while (!consume("}")) {
+  for (;;) {
+    Token *tok = &tokens[token_pos];
+    if (consume("}")) {
+      fn->src_len = tok->str + tok->len - fn->src;
+      break;
+    }
     cur->next = stmt();
     cur = cur->next;
   }
 
+  current_fn_name = NULL;
+  label_count = global_label_count;
+
   fn->node = head.next;
   fn->local_vars = local_vars;
   return fn;
@@ -259,6 +413,10 @@ bool is_type_name() { return peek("int") || peek("char"); }
 //      | "if" "(" expr ")" stmt ("else" stmt)?
 //      | "while" "(" expr ")" stmt
 //      | "for" "(" expr? ";" expr? ";" expr? ")" stmt
+//      | "switch" "(" expr ")" stmt
+//      | "case" "-"? num ":" stmt
+//      | "default" ":" stmt
+//      | "break" ";"
 //      | "{" stmt* "}"
 //      | declaration
 //      | expr ";"
@@ -310,6 +468,52 @@ Node *stmt() {
     return node;
   }
 
+  if ((tok = consume("switch"))) {
+    Node *node = new_node(ND_SWITCH, tok);
+    expect("(");
+    node->cond = expr();
+    expect(")");
+
+    // 本体のcase, defaultをこのswitch文に登録する
+    Node *sw = current_switch;
+    current_switch = node;
+    node->then = stmt();
+    current_switch = sw;
+    return node;
+  }
+
+  if ((tok = consume("case"))) {
+    if (!current_switch)
+      error_tok(tok, "switch文の外でcaseが使われています");
+    int val = consume("-") ? -expect_number() : expect_number();
+    expect(":");
+
+    Node *node = new_node(ND_CASE, tok);
+    node->val = val;
+    node->lhs = stmt();
+    node->case_next = current_switch->case_next;
+    current_switch->case_next = node;
+    return node;
+  }
+
+  if ((tok = consume("default"))) {
+    if (!current_switch)
+      error_tok(tok, "switch文の外でdefaultが使われています");
+    if (current_switch->default_case)
+      error_tok(tok, "defaultが重複しています");
+    expect(":");
+
+    Node *node = new_node(ND_CASE, tok);
+    node->lhs = stmt();
+    current_switch->default_case = node;
+    return node;
+  }
+
+  if ((tok = consume("break"))) {
+    expect(";");
+    return new_node(ND_BREAK, tok);
+  }
+
   if ((tok = consume("{"))) {
     Node *node = new_node(ND_BLOCK, tok);
     Node head;
@@ -318,6 +522,7 @@ Node *stmt() {
 
     // 新しいスコープを作成
     VarList *sc = scope_vars;
+    int sc_id = enter_scope();
 
     while (!consume("}")) {
       cur->next = stmt();
@@ -326,6 +531,7 @@ Node *stmt() {
 
     // スコープを復元
     scope_vars = sc;
+    scope_id = sc_id;
 
     node->body = head.next;
     return node;
@@ -335,7 +541,7 @@ Node *stmt() {
     return declaration();
   }
 
-  tok = token;
+  tok = &tokens[token_pos];
   Node *node = new_node_unary_op(ND_EXPR_STMT, expr(), tok);
   expect(";");
   return node;
@@ -343,7 +549,7 @@ Node *stmt() {
 
 // declaration = basetype ident ("[" num "]")* ("=" expr)? ";"
 Node *declaration() {
-  Token *tok = token;
+  Token *tok = &tokens[token_pos];
   Type *ty = basetype();
   char *name = expect_ident();
   ty = type_suffix(ty);
@@ -361,144 +567,416 @@ Node *declaration() {
   return new_node_unary_op(ND_EXPR_STMT, node, tok);
 }
 
-// expr = assign
-Node *expr() { return assign(); }
-
-// assign = equality ("=" assign)?
-Node *assign() {
-  Node *node = equality();
+// 式は優先順位法で解析する。文法はREADMEのexpr以下と同じ:
+//
+//   優先順位  演算子                 結合
+//   1         = += -= *= /=          右
+//   2         ?:                     右
+//   3         ||                     左
+//   4         &&                     左
+//   5         == !=                  左
+//   6         < <= > >=              左
+//   7         + -                    左
+//   8         * /                    左
+//   9         前置 + - * & ! ++ -- sizeof
+//   10        後置 [] ++ --, 関数呼び出し
+//
+// 被演算子と演算子をそれぞれスタックに積み、優先順位の低い演算子が
+// 来たところで積んである演算子を適用してノードを組み立てる。
+// 括弧・添字・条件演算子・関数呼び出しの引数の始まりも区切りとして
+// 演算子スタックに積むので、入れ子がどれだけ深くてもCのスタックは
+// 使わない。二項演算子を増やすときはbinary_opsに1行足せばよい。
+
+// 演算子の優先順位 (大きいほど強く結び付く)
+typedef enum {
+  PREC_NONE,       // 区切り
+  PREC_ASSIGN,     // = += -= *= /=
+  PREC_COND,       // ?:
+  PREC_LOGOR,      // ||
+  PREC_LOGAND,     // &&
+  PREC_EQUALITY,   // == !=
+  PREC_RELATIONAL, // < <= > >=
+  PREC_ADD,        // + -
+  PREC_MUL,        // * /
+  PREC_UNARY,      // 前置演算子
+} Prec;
+
+// 二項演算子
+typedef struct {
+  char *op;
+  NodeKind kind;
+  Prec prec;
+  bool right_assoc;
+} BinaryOp;
+
+BinaryOp binary_ops[] = {
+    {"=", ND_ASSIGN, PREC_ASSIGN, true},
+    {"+=", ND_ADD_ASSIGN, PREC_ASSIGN, true},
+    {"-=", ND_SUB_ASSIGN, PREC_ASSIGN, true},
+    {"*=", ND_MUL_ASSIGN, PREC_ASSIGN, true},
+    {"/=", ND_DIV_ASSIGN, PREC_ASSIGN, true},
+    {"||", ND_LOGOR, PREC_LOGOR, false},
+    {"&&", ND_LOGAND, PREC_LOGAND, false},
+    {"==", ND_EQ, PREC_EQUALITY, false},
+    {"!=", ND_NE, PREC_EQUALITY, false},
+    {"<", ND_LT, PREC_RELATIONAL, false},
+    {"<=", ND_LE, PREC_RELATIONAL, false},
+    {">", ND_GT, PREC_RELATIONAL, false},
+    {">=", ND_GE, PREC_RELATIONAL, false},
+    {"+", ND_ADD, PREC_ADD, false},
+    {"-", ND_SUB, PREC_ADD, false},
+    {"*", ND_MUL, PREC_MUL, false},
+    {"/", ND_DIV, PREC_MUL, false},
+};
+
+// 前置演算子 ("+"は何もしないので表にない)
+typedef struct {
+  char *op;
+  NodeKind kind; // 作るノード ("sizeof"はND_NUM)
+} PrefixOp;
+
+PrefixOp prefix_ops[] = {
+    {"-", ND_SUB},         // 0 - x
+    {"*", ND_DEREF},
+    {"&", ND_ADDR},
+    {"!", ND_NOT},
+    {"++", ND_ADD_ASSIGN}, // x += 1
+    {"--", ND_SUB_ASSIGN}, // x -= 1
+    {"sizeof", ND_NUM},    // 型のサイズの整数
+};
+
+// 演算子スタックの要素の種類
+typedef enum {
+  OP_BINARY,    // 二項演算子
+  OP_PREFIX,    // 前置演算子
+  OP_COND,      // 条件演算子 (":" まで読んだもの)
+  OP_PAREN,     // "(" ... ")" の区切り
+  OP_SUBSCRIPT, // "[" ... "]" の区切り
+  OP_QUESTION,  // "?" ... ":" の区切り
+  OP_CALL,      // 関数呼び出しの "(" ... ")" の区切り
+} OpKind;
+
+// 演算子スタックの要素
+typedef struct {
+  OpKind kind;
+  NodeKind node_kind; // OP_BINARY, OP_PREFIXで作るノードの種類
+  Prec prec;          // 区切りはPREC_NONE
   Token *tok;
-  if ((tok = consume("=")))
-    node = new_node_binary_op(ND_ASSIGN, node, assign(), tok);
-  return node;
+  int arg_base; // OP_CALLの最初の引数の、被演算子スタック上の位置
+} OpEntry;
+
+// 被演算子スタックの要素。depthは組み立てた木の深さ
+typedef struct {
+  Node *node;
+  int depth;
+} Operand;
+
+// 式の木の深さの上限。パーサーはスタックを使わないが、最適化や
+// コード生成は木を再帰的にたどるので、深すぎる式はCのスタック
+// (THREAD_STACK_SIZE) を使い果たす前にエラーにする。
+// 生成されたコードによくある、10万項の平たい式 (x+x+...+x) まで扱える
+#define MAX_EXPR_DEPTH 100000
+
+// 被演算子スタックと演算子スタック。式文の中の式は、外側の式が
+// 積んだものの上に積む
+_Thread_local Operand *operands;
+_Thread_local int num_operands;
+_Thread_local int operands_capacity;
+_Thread_local OpEntry *ops;
+_Thread_local int num_ops;
+_Thread_local int ops_capacity;
+
+// 深さdepthの木nodeを積む。まだ適用していない演算子はそれぞれ木を
+// 1段深くするので、その数も合わせて上限を超えないか調べる
+void push_operand(Node *node, int depth) {
+  if (depth + num_ops > MAX_EXPR_DEPTH)
+    error_tok(node->tok, "式の入れ子が深すぎます");
+  if (num_operands == operands_capacity) {
+    operands_capacity = operands_capacity ? operands_capacity * 2 : 64;
+    operands = realloc(operands, operands_capacity * sizeof(Operand));
+  }
+  operands[num_operands++] = (Operand){node, depth};
 }
 
-// equality = relational ("==" relational | "!=" relational)*
-Node *equality() {
-  Node *node = relational();
-  Token *tok;
+// 一番上の被演算子を下ろす。*depthをその深さとの大きい方にする
+Node *pop_operand(int *depth) {
+  Operand *op = &operands[--num_operands];
+  if (*depth < op->depth)
+    *depth = op->depth;
+  return op->node;
+}
 
-  for (;;) {
-    if ((tok = consume("==")))
-      node = new_node_binary_op(ND_EQ, node, relational(), tok);
-    else if ((tok = consume("!=")))
-      node = new_node_binary_op(ND_NE, node, relational(), tok);
-    else
-      return node;
+OpEntry *push_op(OpKind kind, Prec prec, Token *tok) {
+  if (num_ops == ops_capacity) {
+    ops_capacity = ops_capacity ? ops_capacity * 2 : 64;
+    ops = realloc(ops, ops_capacity * sizeof(OpEntry));
   }
+  OpEntry *op = &ops[num_ops++];
+  memset(op, 0, sizeof(*op));
+  op->kind = kind;
+  op->prec = prec;
+  op->tok = tok;
+  return op;
 }
 
-// relational = add ("<" add | "<=" add | ">" add | ">=" add)*
-Node *relational() {
-  Node *node = add();
-  Token *tok;
+// 次のトークンが二項演算子ならその表の要素を返す
+BinaryOp *peek_binary_op() {
+  for (int i = 0; i < sizeof(binary_ops) / sizeof(*binary_ops); i++)
+    if (peek(binary_ops[i].op))
+      return &binary_ops[i];
+  return NULL;
+}
 
-  for (;;) {
-    if ((tok = consume("<")))
-      node = new_node_binary_op(ND_LT, node, add(), tok);
-    else if ((tok = consume("<=")))
-      node = new_node_binary_op(ND_LE, node, add(), tok);
-    else if ((tok = consume(">")))
-      node = new_node_binary_op(ND_GT, node, add(), tok);
-    else if ((tok = consume(">=")))
-      node = new_node_binary_op(ND_GE, node, add(), tok);
-    else
-      return node;
-  }
-}
-
-// add = mul ("+" mul | "-" mul)*
-Node *add() {
-  Node *node = mul();
-  Token *tok;
+// 次のトークンが前置演算子ならその表の要素を返す
+PrefixOp *peek_prefix_op() {
+  for (int i = 0; i < sizeof(prefix_ops) / sizeof(*prefix_ops); i++)
+    if (peek(prefix_ops[i].op))
+      return &prefix_ops[i];
+  return NULL;
+}
 
-  for (;;) {
-    if ((tok = consume("+")))
-      node = new_node_binary_op(ND_ADD, node, mul(), tok);
-    else if ((tok = consume("-")))
-      node = new_node_binary_op(ND_SUB, node, mul(), tok);
-    else
-      return node;
+// 演算子スタックの一番上の演算子を被演算子に適用する
+void apply_op() {
+  OpEntry *op = &ops[--num_ops];
+  Token *tok = op->tok;
+  int depth = 0;
+
+  if (op->kind == OP_BINARY) {
+    Node *rhs = pop_operand(&depth);
+    Node *lhs = pop_operand(&depth);
+    push_operand(new_node_binary_op(op->node_kind, lhs, rhs, tok), depth + 1);
+    return;
   }
-}
 
-// mul = unary ("*" unary | "/" unary)*
-Node *mul() {
-  Node *node = unary();
-  Token *tok;
+  if (op->kind == OP_COND) {
+    Node *node = new_node(ND_COND, tok);
+    node->els = pop_operand(&depth);
+    node->then = pop_operand(&depth);
+    node->cond = pop_operand(&depth);
+    add_type(node);
+    push_operand(node, depth + 1);
+    return;
+  }
 
-  for (;;) {
-    if ((tok = consume("*")))
-      node = new_node_binary_op(ND_MUL, node, unary(), tok);
-    else if ((tok = consume("/")))
-      node = new_node_binary_op(ND_DIV, node, unary(), tok);
-    else
-      return node;
+  Node *operand = pop_operand(&depth);
+  switch (op->node_kind) {
+  case ND_SUB:
+    push_operand(
+        new_node_binary_op(ND_SUB, new_node_num(0, tok), operand, tok),
+        depth + 1);
+    return;
+  case ND_ADD_ASSIGN:
+  case ND_SUB_ASSIGN:
+    push_operand(new_node_binary_op(op->node_kind, operand,
+                                    new_node_num(1, tok), tok),
+                 depth + 1);
+    return;
+  case ND_NUM:
+    push_operand(new_node_num(size_of(operand->ty), tok), 1);
+    return;
+  default:
+    push_operand(new_node_unary_op(op->node_kind, operand, tok), depth + 1);
+    return;
   }
 }
 
-// unary = ("+" | "-" | "*" | "&")? unary | postfix
-Node *unary() {
-  Token *tok;
-  if ((tok = consume("+")))
-    return unary();
-  if ((tok = consume("-")))
-    return new_node_binary_op(ND_SUB, new_node_num(0, tok), unary(), tok);
-  if ((tok = consume("*")))
-    return new_node_unary_op(ND_DEREF, unary(), tok);
-  if ((tok = consume("&")))
-    return new_node_unary_op(ND_ADDR, unary(), tok);
-  return postfix();
-}
-
-// postfix = primary ("[" expr "]")*
-Node *postfix() {
-  Node *node = primary();
-  Token *tok;
+// 演算子スタックのbaseより上にある、優先順位がmin_prec以上の演算子を
+// 適用する。区切りのところで止まる
+void reduce_ops(int base, Prec min_prec) {
+  while (num_ops > base && ops[num_ops - 1].prec >= min_prec)
+    apply_op();
+}
 
-  while ((tok = consume("["))) {
-    // x[i] は *(x+i) の構文糖衣
-    Node *exp = new_node_binary_op(ND_ADD, node, expr(), tok);
-    expect("]");
-    node = new_node_unary_op(ND_DEREF, exp, tok);
-  }
+// 関数呼び出しのノードを作る。argsはnextでつながった引数のリスト
+Node *new_fun_call(Token *tok, Node *args) {
+  Node *node = new_node(ND_FUN_CALL, tok);
+  node->func_name = duplicate_string_n(tok->str, tok->len);
+  node->args = args;
+  add_type(node);
   return node;
 }
 
+// 先読み: 関数呼び出しかどうか
+bool peek_is_call() {
+  int saved = token_pos;
+  bool result = consume_ident() && consume("(");
+  token_pos = saved;
+  return result;
+}
+
 // 先読み: stmt-expr かどうか
 bool peek_is_stmt_expr() {
-  Token *saved = token;
+  int saved = token_pos;
   bool result = consume("(") && consume("{");
-  token = saved;
+  token_pos = saved;
   return result;
 }
 
-// primary = "(" "{" stmt-expr-tail
-//         | "(" expr ")"
-//         | "sizeof" unary
-//         | ident func-args?
+// 被演算子を1つ読む。前置演算子・開き括弧・関数呼び出しの始まりは
+// 演算子スタックに積み、一次式を被演算子スタックに積む
+void read_operand() {
+  for (;;) {
+    Token *tok = &tokens[token_pos];
+    if (consume("+"))
+      continue;
+
+    PrefixOp *pre = peek_prefix_op();
+    if (pre) {
+      token_pos++;
+      push_op(OP_PREFIX, PREC_UNARY, tok)->node_kind = pre->kind;
+      continue;
+    }
+
+    if (!peek_is_stmt_expr() && consume("(")) {
+      push_op(OP_PAREN, PREC_NONE, tok);
+      continue;
+    }
+
+    // 関数呼び出し: 引数があれば最初の引数を読みに行く
+    if (peek_is_call()) {
+      token_pos += 2;
+      if (consume(")")) {
+        push_operand(new_fun_call(tok, NULL), 1);
+        return;
+      }
+      push_op(OP_CALL, PREC_NONE, tok)->arg_base = num_operands;
+      continue;
+    }
+
+    push_operand(primary(), 1);
+    return;
+  }
+}
+
+// 被演算子の後ろを読む。後置演算子と閉じ括弧はその場で処理し、
+// 二項演算子などを積んで次の被演算子が必要になったら真を返す。
+// 式の終わりなら偽を返す
+bool read_operator(int base) {
+  for (;;) {
+    Token *tok = &tokens[token_pos];
+
+    // 後置++/--: 右辺の1は加減算する量
+    if (consume("++") || consume("--")) {
+      NodeKind kind = tok->str[0] == '+' ? ND_POST_INC : ND_POST_DEC;
+      int depth = 0;
+      Node *node = pop_operand(&depth);
+      push_operand(
+          new_node_binary_op(kind, node, new_node_num(1, tok), tok),
+          depth + 1);
+      continue;
+    }
+
+    if (consume("[")) {
+      push_op(OP_SUBSCRIPT, PREC_NONE, tok);
+      return true;
+    }
+
+    // 右結合の演算子は、同じ優先順位の演算子を先に適用しない
+    BinaryOp *bin = peek_binary_op();
+    if (bin) {
+      token_pos++;
+      reduce_ops(base, bin->right_assoc ? bin->prec + 1 : bin->prec);
+      push_op(OP_BINARY, bin->prec, tok)->node_kind = bin->kind;
+      return true;
+    }
+
+    if (consume("?")) {
+      reduce_ops(base, PREC_COND + 1);
+      push_op(OP_QUESTION, PREC_NONE, tok);
+      return true;
+    }
+
+    // 閉じ括弧の類は、一番内側の区切りまで演算子を適用してから調べる。
+    // 対応する区切りがなければ式の終わり
+    if (!peek(":") && !peek(")") && !peek("]") && !peek(","))
+      return false;
+    reduce_ops(base, PREC_ASSIGN);
+    if (num_ops == base)
+      return false;
+    OpEntry *top = &ops[num_ops - 1];
+
+    if (top->kind == OP_QUESTION && consume(":")) {
+      top->kind = OP_COND;
+      top->prec = PREC_COND;
+      return true;
+    }
+
+    if (top->kind == OP_PAREN && consume(")")) {
+      num_ops--;
+      continue;
+    }
+
+    // x[i] は *(x+i) の構文糖衣
+    if (top->kind == OP_SUBSCRIPT && consume("]")) {
+      num_ops--;
+      int depth = 0;
+      Node *index = pop_operand(&depth);
+      Node *exp =
+          new_node_binary_op(ND_ADD, pop_operand(&depth), index, top->tok);
+      push_operand(new_node_unary_op(ND_DEREF, exp, top->tok), depth + 2);
+      continue;
+    }
+
+    if (top->kind == OP_CALL && consume(","))
+      return true;
+
+    // 引数を被演算子スタックから下ろしてつなぐ
+    if (top->kind == OP_CALL && consume(")")) {
+      num_ops--;
+      Node *args = NULL;
+      int depth = 0;
+      while (num_operands > top->arg_base) {
+        Node *arg = pop_operand(&depth);
+        arg->next = args;
+        args = arg;
+      }
+      push_operand(new_fun_call(top->tok, args), depth + 1);
+      continue;
+    }
+
+    return false;
+  }
+}
+
+// 区切りに対応する閉じ括弧
+char *closing_of(OpKind kind) {
+  switch (kind) {
+  case OP_SUBSCRIPT:
+    return "]";
+  case OP_QUESTION:
+    return ":";
+  default:
+    return ")";
+  }
+}
+
+// expr = 上の表の演算子と一次式からなる式
+Node *expr() {
+  int base = num_ops;
+  do
+    read_operand();
+  while (read_operator(base));
+
+  // 残った演算子を適用する。区切りが残っていれば閉じ括弧が足りない
+  reduce_ops(base, PREC_ASSIGN);
+  if (num_ops > base)
+    expect(closing_of(ops[num_ops - 1].kind));
+  int depth = 0;
+  return pop_operand(&depth);
+}
+
+// primary = stmt-expr
+//         | ident
 //         | str
 //         | num
+// 括弧・関数呼び出し・sizeofはread_operandで扱う
 Node *primary() {
   Token *tok;
 
   if (peek_is_stmt_expr())
     return stmt_expr();
 
-  if (consume("(")) {
-    Node *node = expr();
-    expect(")");
-    return node;
-  }
-
   if ((tok = consume_ident())) {
-    if (consume("(")) {
-      Node *node = new_node(ND_FUN_CALL, tok);
-      node->func_name = duplicate_string_n(tok->str, tok->len);
-      node->args = func_args();
-      return node;
-    }
-
     Var *var = find_var(tok);
     if (!var) {
       error_tok(tok, "未定義の変数です");
@@ -506,13 +984,9 @@ Node *primary() {
     return new_var(var, tok);
   }
 
-  if ((tok = consume("sizeof"))) {
-    return new_node_unary_op(ND_SIZEOF, unary(), tok);
-  }
-
-  tok = token;
+  tok = &tokens[token_pos];
   if (tok->kind == TK_STR) {
-    token = token->next;
+    token_pos++;
 
     // char[N] 型を作る
     Type *ty = array_of(char_type(), tok->contents_len);
@@ -531,42 +1005,31 @@ Node *primary() {
 
 // stmt-expr = "(" "{" stmt+ "}" ")"
 Node *stmt_expr() {
-  Token *tok = token;
+  Token *tok = &tokens[token_pos];
   expect("(");
   expect("{");
 
   VarList *sc = scope_vars;
+  int sc_id = enter_scope();
 
   Node *node = new_node(ND_STMT_EXPR, tok);
   node->body = stmt();
-  Node *cur = node->body;
+  Node **last = &node->body;
 
   while (!consume("}")) {
-    cur->next = stmt();
-    cur = cur->next;
+    (*last)->next = stmt();
+    last = &(*last)->next;
   }
   expect(")");
 
   scope_vars = sc;
+  scope_id = sc_id;
 
+  // 最後の式文を、その式に置き換える
+  Node *cur = *last;
   if (cur->kind != ND_EXPR_STMT)
     error_tok(cur->tok, "voidを返すstatement expressionはサポートしていません");
-  *cur = *cur->lhs;
+  *last = cur->lhs;
+  add_type(node);
   return node;
 }
-
-// func-args = "(" (assign ("," assign)*)? ")"
-Node *func_args() {
-  if (consume(")")) {
-    return NULL;
-  }
-
-  Node *head = assign();
-  Node *cur = head;
-  while (consume(",")) {
-    cur->next = assign();
-    cur = cur->next;
-  }
-  expect(")");
-  return head;
-}
@@ -0,0 +1,375 @@
+#include "he3cc.h"
+
+// 命令スケジューリング
+//
+// Cortex-A53/A55のようなインオーダーコアでは、ロードや乗除算の結果を
+// 直後の命令で使うとパイプラインが止まる。基本ブロックの中で依存関係を
+// 保ったまま命令を並べ替え、結果を待つ間に独立した命令を実行させる。
+
+// 依存関係を表すレジスタ集合のビット
+//   0〜30: x0〜x30, 31: sp, 32: 条件フラグ(NZCV)
+#define REG_SP 31
+#define REG_FLAGS 32
+
+// 一度に並べ替える命令の数の上限。依存関係の表は命令数の2乗の大きさに
+// なるので、長い基本ブロックはこの数ずつに区切ってスケジューリングする
+#define SCHED_WINDOW 256
+
+// 命令の種類
+typedef enum {
+  IC_ALU,    // 整数演算・移動
+  IC_LOAD,   // メモリからのロード
+  IC_STORE,  // メモリへのストア
+  IC_MUL,    // 乗算
+  IC_DIV,    // 除算
+  IC_BRANCH, // 分岐・呼び出し (基本ブロックの終わり)
+  IC_OTHER,  // 解析できない命令・ラベル・ディレクティブ
+} InsnClass;
+
+// スケジューリング対象の命令
+typedef struct {
+  Insn *insn;
+  InsnClass cls;
+  unsigned long defs; // 書き込むレジスタ
+  unsigned long uses; // 読み出すレジスタ
+  int latency;        // 結果が使えるようになるまでのサイクル数
+
+  int npreds;    // まだスケジュールされていない先行命令の数
+  int height;    // ブロックの終わりまでの最長経路 (優先度)
+  int ready;     // 発行できる最も早いサイクル
+  bool done;     // スケジュール済みか
+} SchedInsn;
+
+// 命令の種類ごとのレイテンシ (Cortex-A53程度)
+int insn_latency(InsnClass cls) {
+  switch (cls) {
+  case IC_LOAD:
+    return 3;
+  case IC_MUL:
+    return 3;
+  case IC_DIV:
+    return 12;
+  default:
+    return 1;
+  }
+}
+
+// オペランドがレジスタなら、その番号を返す。そうでなければ-1を返す
+int reg_number(char *s) {
+  if (!strcmp(s, "sp") || !strcmp(s, "wsp"))
+    return REG_SP;
+  if (*s != 'x' && *s != 'w')
+    return -1;
+  char *end;
+  long n = strtol(s + 1, &end, 10);
+  if (end == s + 1 || *end || n < 0 || n > 30)
+    return -1;
+  return n;
+}
+
+// 文字列の前後の空白を取り除く
+char *trim(char *s) {
+  while (isspace(*s))
+    s++;
+  char *end = s + strlen(s);
+  while (end > s && isspace(end[-1]))
+    *--end = '\0';
+  return s;
+}
+
+// オペランド文字列を、角括弧の外のカンマで分割する
+int split_operands(char *s, char **ops, int max) {
+  int n = 0;
+  int depth = 0;
+  ops[n++] = s;
+  for (char *p = s; *p; p++) {
+    if (*p == '[')
+      depth++;
+    else if (*p == ']')
+      depth--;
+    else if (*p == ',' && depth == 0 && n < max) {
+      *p = '\0';
+      ops[n++] = p + 1;
+    }
+  }
+  for (int i = 0; i < n; i++)
+    ops[i] = trim(ops[i]);
+  return n;
+}
+
+// レジスタのオペランドならそのビットを返す
+unsigned long reg_bit(char *op) {
+  int r = reg_number(op);
+  return r < 0 ? 0 : 1UL << r;
+}
+
+// メモリオペランド [base, index, ...] が読むレジスタのビットを返す
+unsigned long mem_regs(char *op) {
+  char buf[256];
+  snprintf(buf, sizeof(buf), "%s", op + 1);
+  char *close = strchr(buf, ']');
+  if (close)
+    *close = '\0';
+
+  char *parts[4];
+  int n = split_operands(buf, parts, 4);
+  unsigned long regs = 0;
+  for (int i = 0; i < n; i++)
+    regs |= reg_bit(parts[i]);
+  return regs;
+}
+
+bool startswith_op(char *op, char *prefix) {
+  return !strncmp(op, prefix, strlen(prefix));
+}
+
+// 1行を解析して、種類と読み書きするレジスタを求める
+void analyze(SchedInsn *si) {
+  si->cls = IC_OTHER;
+  char *text = si->insn->text;
+
+  // 命令は空白で始まる。ラベルとディレクティブは並べ替えない
+  if (!isspace(*text))
+    return;
+  char buf[512];
+  snprintf(buf, sizeof(buf), "%s", text);
+  char *line = trim(buf);
+  if (*line == '.' || *line == '\0')
+    return;
+
+  char *op = line;
+  char *args = "";
+  char *sp = strchr(line, ' ');
+  if (sp) {
+    *sp = '\0';
+    args = sp + 1;
+  }
+
+  char *ops[8];
+  int n = *args ? split_operands(args, ops, 8) : 0;
+
+  // 分岐と呼び出しは基本ブロックの終わり
+  if (!strcmp(op, "b") || startswith_op(op, "b.") || !strcmp(op, "bl") ||
+      !strcmp(op, "br") || !strcmp(op, "blr") || !strcmp(op, "ret") ||
+      !strcmp(op, "cbz") || !strcmp(op, "cbnz")) {
+    si->cls = IC_BRANCH;
+    return;
+  }
+
+  // ロード・ストア
+  bool is_load = startswith_op(op, "ldr") || startswith_op(op, "ldur") ||
+                 !strcmp(op, "ldp");
+  bool is_store = startswith_op(op, "str") || startswith_op(op, "stur") ||
+                  !strcmp(op, "stp");
+  if (is_load || is_store) {
+    int nregs = (!strcmp(op, "ldp") || !strcmp(op, "stp")) ? 2 : 1;
+    if (n < nregs + 1 || ops[nregs][0] != '[')
+      return;
+
+    char *mem = ops[nregs];
+    unsigned long base = mem_regs(mem);
+    si->uses |= base;
+    // プリインデックス ([base, #imm]!) とポストインデックス ([base], #imm)
+    // はベースレジスタを書き換える
+    if (mem[strlen(mem) - 1] == '!' || n > nregs + 1) {
+      char buf2[256];
+      snprintf(buf2, sizeof(buf2), "%s", mem + 1);
+      *strpbrk(buf2, ",]") = '\0';
+      si->defs |= reg_bit(trim(buf2));
+    }
+
+    for (int i = 0; i < nregs; i++) {
+      if (is_load)
+        si->defs |= reg_bit(ops[i]);
+      else
+        si->uses |= reg_bit(ops[i]);
+    }
+    si->cls = is_load ? IC_LOAD : IC_STORE;
+    return;
+  }
+
+  // 比較はフラグだけを書き換える
+  if (!strcmp(op, "cmp") || !strcmp(op, "cmn") || !strcmp(op, "tst")) {
+    for (int i = 0; i < n; i++)
+      si->uses |= reg_bit(ops[i]);
+    si->defs |= 1UL << REG_FLAGS;
+    si->cls = IC_ALU;
+    return;
+  }
+
+  static char *alu_ops[] = {
+      "mov",  "movz", "movn", "movk", "add",  "sub",  "neg",  "and",
+      "orr",  "eor",  "lsl",  "lsr",  "asr",  "sxtb", "sxtw", "uxtb",
+      "adrp", "adr",  "cset", "csel", "csinc", "csinv", "csneg", "mul",
+      "madd", "msub", "sdiv", "udiv",
+  };
+  bool known = false;
+  for (int i = 0; i < sizeof(alu_ops) / sizeof(*alu_ops); i++)
+    if (!strcmp(op, alu_ops[i]))
+      known = true;
+  if (!known || n == 0)
+    return;
+
+  // 先頭のオペランドに書き込み、残りを読む。movkは書き込み先も読む
+  si->defs |= reg_bit(ops[0]);
+  if (!strcmp(op, "movk"))
+    si->uses |= reg_bit(ops[0]);
+  for (int i = 1; i < n; i++)
+    si->uses |= reg_bit(ops[i]);
+
+  if (startswith_op(op, "cs") || !strcmp(op, "cset"))
+    si->uses |= 1UL << REG_FLAGS;
+
+  if (!strcmp(op, "mul") || !strcmp(op, "madd") || !strcmp(op, "msub"))
+    si->cls = IC_MUL;
+  else if (!strcmp(op, "sdiv") || !strcmp(op, "udiv"))
+    si->cls = IC_DIV;
+  else
+    si->cls = IC_ALU;
+}
+
+// 命令iの後に命令jを置かなければならないとき、その間に必要なサイクル数を
+// 返す。依存がなければ-1を返す
+int dependence(SchedInsn *i, SchedInsn *j) {
+  int lat = -1;
+
+  // 読み出し後の書き込み・書き込み後の書き込み: 順序だけ守る
+  if ((i->uses & j->defs) || (i->defs & j->defs))
+    lat = 0;
+  // 書き込み後の読み出し: 結果が出るまで待つ
+  if (i->defs & j->uses)
+    lat = i->latency;
+
+  // メモリは同じ場所かどうか分からないので、ストアをまたいで動かさない
+  if ((i->cls == IC_STORE && (j->cls == IC_LOAD || j->cls == IC_STORE)) ||
+      (i->cls == IC_LOAD && j->cls == IC_STORE))
+    lat = lat > 1 ? lat : 1;
+
+  // spを書き換える命令をまたいでメモリアクセスを動かさない。
+  // AArch64 Linuxにはレッドゾーンがなく、spより下はシグナルハンドラに
+  // 壊されうるので、フレームの確保より前に局所変数へストアしてはいけない
+  bool i_mem = i->cls == IC_LOAD || i->cls == IC_STORE;
+  bool j_mem = j->cls == IC_LOAD || j->cls == IC_STORE;
+  unsigned long sp = 1UL << REG_SP;
+  if (((i->defs & sp) && j_mem) || (i_mem && (j->defs & sp)))
+    lat = lat > 0 ? lat : 0;
+
+  // ブロック末尾の分岐は最後に置く
+  if (j->cls == IC_BRANCH && lat < 0)
+    lat = 0;
+  return lat;
+}
+
+// 基本ブロック blk[0..n) をリストスケジューリングし、並べ替えた命令列を
+// *tailの後ろにつなぐ
+void schedule_block(SchedInsn *blk, int n, Insn **tail) {
+  if (n == 0)
+    return;
+
+  // 依存関係の表 (lat[i][j]: iの後にjを置くのに必要なサイクル数)
+  int *lat = calloc((size_t)n * n, sizeof(int));
+  if (!lat)
+    error("メモリが足りません");
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < n; j++) {
+      lat[i * n + j] = j > i ? dependence(&blk[i], &blk[j]) : -1;
+      if (lat[i * n + j] >= 0)
+        blk[j].npreds++;
+    }
+  }
+
+  // 優先度: ブロックの終わりまでのレイテンシの最長経路
+  for (int i = n - 1; i >= 0; i--) {
+    blk[i].height = blk[i].latency;
+    for (int j = i + 1; j < n; j++) {
+      int h = lat[i * n + j] + blk[j].height;
+      if (lat[i * n + j] >= 0 && h > blk[i].height)
+        blk[i].height = h;
+    }
+  }
+
+  // 1サイクルに1命令ずつ、発行できるものの中で優先度が最も高い命令を選ぶ。
+  // 発行できる命令がなければ、最も早く発行できるものを選ぶ
+  int cycle = 0;
+  for (int count = 0; count < n; count++) {
+    int best = -1;
+    for (int i = 0; i < n; i++) {
+      SchedInsn *si = &blk[i];
+      if (si->done || si->npreds)
+        continue;
+      if (best < 0) {
+        best = i;
+        continue;
+      }
+      SchedInsn *b = &blk[best];
+      bool si_ok = si->ready <= cycle;
+      bool b_ok = b->ready <= cycle;
+      if (si_ok != b_ok) {
+        if (si_ok)
+          best = i;
+        continue;
+      }
+      if (si_ok ? si->height > b->height : si->ready < b->ready)
+        best = i;
+    }
+
+    SchedInsn *si = &blk[best];
+    if (si->ready > cycle)
+      cycle = si->ready;
+    si->done = true;
+    for (int j = 0; j < n; j++) {
+      int l = lat[best * n + j];
+      if (l < 0)
+        continue;
+      blk[j].npreds--;
+      if (blk[j].ready < cycle + l)
+        blk[j].ready = cycle + l;
+    }
+    cycle++;
+
+    si->insn->next = NULL;
+    (*tail)->next = si->insn;
+    *tail = si->insn;
+  }
+  free(lat);
+}
+
+// 関数1つ分の命令列を、基本ブロックごとにスケジューリングして返す
+Insn *schedule(Insn *insns) {
+  int len = 0;
+  for (Insn *insn = insns; insn; insn = insn->next)
+    len++;
+  SchedInsn *blk = calloc(len, sizeof(SchedInsn));
+
+  Insn head = {0};
+  Insn *tail = &head;
+  int n = 0;
+
+  for (Insn *insn = insns, *next; insn; insn = next) {
+    next = insn->next;
+    SchedInsn *si = &blk[n];
+    memset(si, 0, sizeof(*si));
+    si->insn = insn;
+    analyze(si);
+    si->latency = insn_latency(si->cls);
+
+    if (si->cls == IC_OTHER) {
+      // ラベルや解析できない行の前後で基本ブロックを区切る
+      schedule_block(blk, n, &tail);
+      n = 0;
+      insn->next = NULL;
+      tail->next = insn;
+      tail = insn;
+      continue;
+    }
+
+    n++;
+    if (si->cls == IC_BRANCH || n == SCHED_WINDOW) {
+      schedule_block(blk, n, &tail);
+      n = 0;
+    }
+  }
+  schedule_block(blk, n, &tail);
+  free(blk);
+  return head.next;
+}
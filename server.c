@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+#include "he3cc.h"
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// コンパイルサーバー (--server) とクライアント (--client)
+//
+// サーバーはUnixドメインソケットで待ち受け、クライアントから受け取った
+// 引数でコンパイルする。クライアントは作業ディレクトリと引数に加えて
+// 標準入出力のファイルディスクリプタを渡すので、コンパイル結果や
+// エラーメッセージはクライアントが直接出力したのと同じ所に書き出される。
+// 終了コードはサーバーから送り返され、クライアントの終了コードになる。
+// 標準入力も渡すので、ファイルの代わりに "-" を指定すれば、ソースの内容を
+// クライアントの標準入力から送れる。
+//
+// 要求ごとに、起動済みのサーバーをforkした子プロセスでコンパイルする。
+// execもプログラムの読み込みも行わずに始められ、子プロセスが確保した
+// メモリは終了時にまとめて捨てられるので、次の要求には残らない。
+// error()はそのままexitしてよく、サーバーは止まらない。
+
+// 要求の大きさの上限
+#define MAX_REQUEST (1 << 20)
+
+// ソケットのアドレスを作る
+struct sockaddr_un socket_addr(char *path) {
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    error("ソケットのパスが長すぎます: %s", path);
+  strcpy(addr.sun_path, path);
+  return addr;
+}
+
+// lenバイトを全て書き込む。失敗したらfalseを返す
+bool write_all(int fd, void *buf, int len) {
+  for (char *p = buf; len > 0;) {
+    int n = write(fd, p, len);
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+// lenバイトを全て読み込む。失敗したらfalseを返す
+bool read_all(int fd, void *buf, int len) {
+  for (char *p = buf; len > 0;) {
+    int n = read(fd, p, len);
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+// 要求を受け取り、標準入出力を差し替え、作業ディレクトリに移って
+// コンパイルする。この関数は戻らない
+void serve_request(int conn) {
+  // 要求の長さと一緒に、クライアントの標準入出力を受け取る
+  int len;
+  int fds[3];
+  char control[CMSG_SPACE(sizeof(fds))];
+  struct iovec iov = {&len, sizeof(len)};
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (recvmsg(conn, &msg, 0) != sizeof(len) || len <= 0 || len > MAX_REQUEST)
+    _exit(1);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+    _exit(1);
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+  // 本体は "作業ディレクトリ\0引数1\0引数2\0..." の形
+  char *buf = calloc(1, len + 1);
+  if (!read_all(conn, buf, len))
+    _exit(1);
+  int argc = 1;
+  for (int i = 0; i < len; i++)
+    if (buf[i] == '\0')
+      argc++;
+  char **argv = calloc(argc + 1, sizeof(char *));
+  argv[0] = "he3cc";
+  argc = 1;
+  char *cwd = buf;
+  for (char *p = buf + strlen(buf) + 1; p < buf + len; p += strlen(p) + 1)
+    argv[argc++] = p;
+
+  for (int i = 0; i < 3; i++) {
+    dup2(fds[i], i);
+    close(fds[i]);
+  }
+  close(conn);
+  if (chdir(cwd))
+    error("ディレクトリに移動できません %s: %s", cwd, strerror(errno));
+  exit(compile_main(argc, argv));
+}
+
+// 1つの接続を処理する。コンパイルする子プロセスの終了を待ち、
+// 終了コードをクライアントに返す
+void handle_connection(int conn) {
+  pid_t pid = fork();
+  if (pid < 0)
+    _exit(1);
+  if (pid == 0)
+    serve_request(conn);
+
+  int status;
+  waitpid(pid, &status, 0);
+  int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+  write_all(conn, &code, sizeof(code));
+  _exit(0);
+}
+
+// pathのソケットで待ち受け、要求を処理し続ける
+int run_server(char *path) {
+  struct sockaddr_un addr = socket_addr(path);
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0)
+    error("ソケットを作成できません: %s", strerror(errno));
+  // 前回のサーバーが残したソケットだけを消す
+  struct stat st;
+  if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+    unlink(path);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(sock, 64))
+    error("ソケットで待ち受けられません %s: %s", path, strerror(errno));
+
+  // 接続ごとのプロセスは待たずに回収させる
+  signal(SIGCHLD, SIG_IGN);
+
+  for (;;) {
+    int conn = accept(sock, NULL, NULL);
+    if (conn < 0) {
+      if (errno == EINTR)
+        continue;
+      error("接続を受け付けられません: %s", strerror(errno));
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(sock);
+      signal(SIGCHLD, SIG_DFL);
+      handle_connection(conn);
+    }
+    close(conn);
+  }
+}
+
+// pathのサーバーに引数を送ってコンパイルさせ、その終了コードを返す。
+// サーバーに接続できなければ-1を返す
+int run_client(char *path, int argc, char **argv) {
+  struct sockaddr_un addr = socket_addr(path);
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+    if (sock >= 0)
+      close(sock);
+    return -1;
+  }
+
+  char *cwd = getcwd(NULL, 0);
+  if (!cwd)
+    error("作業ディレクトリが分かりません: %s", strerror(errno));
+  int len = strlen(cwd) + 1;
+  for (int i = 0; i < argc; i++)
+    len += strlen(argv[i]) + 1;
+  if (len > MAX_REQUEST)
+    error("引数が長すぎます");
+  char *buf = calloc(1, len);
+  char *p = buf;
+  p = stpcpy(p, cwd) + 1;
+  for (int i = 0; i < argc; i++)
+    p = stpcpy(p, argv[i]) + 1;
+
+  // 要求の長さと一緒に、標準入出力のファイルディスクリプタを渡す
+  int fds[3] = {0, 1, 2};
+  char control[CMSG_SPACE(sizeof(fds))] = {0};
+  struct iovec iov = {&len, sizeof(len)};
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  int code;
+  if (sendmsg(sock, &msg, 0) != sizeof(len) || !write_all(sock, buf, len) ||
+      !read_all(sock, &code, sizeof(code)))
+    error("サーバーとの通信に失敗しました: %s", path);
+  close(sock);
+  return code;
+}
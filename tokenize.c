@@ -1,16 +1,31 @@
+#define _GNU_SOURCE
 #include "he3cc.h"
 
-// 現在着目しているトークン
-Token *token;
+// トークン列 (TK_EOFのトークンで終わる)
+_Thread_local Token *tokens;
+_Thread_local int num_tokens;
+_Thread_local int tokens_capacity;
+
+// 現在着目しているトークンの位置
+_Thread_local int token_pos;
 
 // 入力ファイル名
-char *filename;
+_Thread_local char *filename;
 
 // 入力プログラム
-char *user_input;
+_Thread_local char *user_input;
+
+// 入力の各行の先頭の、user_inputからの位置。行番号が初めて必要に
+// なったときに入力を一度だけ走査して作る (num_linesが0なら未作成)
+_Thread_local int *line_offsets;
+_Thread_local int num_lines;
+_Thread_local int line_offsets_capacity;
 
-// エラーを報告するための関数
+// エラーを報告するための関数。
+// コード生成のスレッドが同時にエラーを報告しても出力が混ざらないよう、
+// stderrをロックしたまま終了する (以下のエラー報告も同じ)
 void error(char *fmt, ...) {
+  flockfile(stderr);
   va_list ap;
   va_start(ap, fmt);
   vfprintf(stderr, fmt, ap);
@@ -18,32 +33,74 @@ void error(char *fmt, ...) {
   exit(1);
 }
 
+// 行の先頭の位置の表を作る
+void build_line_offsets() {
+  num_lines = 0;
+  for (char *p = user_input; p;) {
+    if (num_lines == line_offsets_capacity) {
+      line_offsets_capacity =
+          line_offsets_capacity ? line_offsets_capacity * 2 : 1024;
+      line_offsets =
+          realloc(line_offsets, line_offsets_capacity * sizeof(int));
+    }
+    line_offsets[num_lines++] = p - user_input;
+
+    p = strchr(p, '\n');
+    if (p)
+      p++;
+  }
+}
+
+// locがある行の番号 (1から数える) を返す
+int line_number(char *loc) {
+  if (!num_lines)
+    build_line_offsets();
+
+  // line_offsets[lo] <= loc < line_offsets[hi] を保って範囲を狭める
+  int offset = loc - user_input;
+  int lo = 0;
+  int hi = num_lines;
+  while (hi - lo > 1) {
+    int mid = (lo + hi) / 2;
+    if (line_offsets[mid] <= offset)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo + 1;
+}
+
+// line_num行目の先頭を返す
+char *line_start(int line_num) {
+  if (!num_lines)
+    build_line_offsets();
+  return user_input + line_offsets[line_num - 1];
+}
+
+// locの行の中での桁 (1から数える。バイト単位) を返す
+int column_number(char *loc) { return loc - line_start(line_number(loc)) + 1; }
+
 // エラーメッセージを以下の形式で出力:
 //
 // foo.c:10: x = y + 1;
 //           ^ エラーメッセージ
 void verror_at(char *loc, char *fmt, va_list ap) {
+  flockfile(stderr);
+
   // loc を含む行を探す
-  char *line = loc;
-  while (user_input < line && line[-1] != '\n')
-    line--;
+  int line_num = line_number(loc);
+  char *line = line_start(line_num);
 
   char *end = loc;
   while (*end != '\n')
     end++;
 
-  // 行番号を取得
-  int line_num = 1;
-  for (char *p = user_input; p < line; p++)
-    if (*p == '\n')
-      line_num++;
-
   // 行を出力
   int indent = fprintf(stderr, "%s:%d: ", filename, line_num);
   fprintf(stderr, "%.*s\n", (int)(end - line), line);
 
   // エラー位置を示す
-  int pos = loc - line + indent;
+  int pos = column_number(loc) - 1 + indent;
   fprintf(stderr, "%*s", pos, "");
   fprintf(stderr, "^ ");
   vfprintf(stderr, fmt, ap);
@@ -60,6 +117,7 @@ void error_at(char *loc, char *fmt, ...) {
 
 // エラー箇所を報告する
 void error_tok(Token *tok, char *fmt, ...) {
+  flockfile(stderr);
   va_list ap;
   va_start(ap, fmt);
   if (tok) {
@@ -74,30 +132,29 @@ void error_tok(Token *tok, char *fmt, ...) {
 // 次のトークンが期待している記号のときには、
 // 真を返す。それ以外の場合には偽を返す。
 Token *peek(char *s) {
-  if (token->kind != TK_RESERVED || strlen(s) != token->len ||
-      memcmp(token->str, s, token->len))
+  Token *tok = &tokens[token_pos];
+  if (tok->kind != TK_RESERVED || strlen(s) != tok->len ||
+      memcmp(tok->str, s, tok->len))
     return NULL;
-  return token;
+  return tok;
 }
 
 // 次のトークンが期待している記号のときには、トークンを1つ読み進めて
 // 真を返す。それ以外の場合には偽を返す。
 Token *consume(char *s) {
-  if (!peek(s))
-    return NULL;
-
-  Token *t = token;
-  token = token->next;
-  return t;
+  Token *tok = peek(s);
+  if (tok)
+    token_pos++;
+  return tok;
 }
 
 // 次のトークンが識別子の場合、トークンを1つ読み進めてそのトークンを返す。
 // それ以外の場合には偽を返す。
 Token *consume_ident() {
-  if (token->kind != TK_IDENT)
+  Token *tok = &tokens[token_pos];
+  if (tok->kind != TK_IDENT)
     return NULL;
-  Token *tok = token;
-  token = token->next;
+  token_pos++;
   return tok;
 }
 
@@ -105,31 +162,31 @@ Token *consume_ident() {
 // それ以外の場合にはエラーを報告する。
 void expect(char *s) {
   if (!peek(s))
-    error_tok(token, "'%s'が必要です", s);
-  token = token->next;
+    error_tok(&tokens[token_pos], "'%s'が必要です", s);
+  token_pos++;
 }
 
 // 次のトークンが数値の場合、トークンを1つ読み進めてその数値を返す。
 // それ以外の場合にはエラーを報告する。
 int expect_number() {
-  if (token->kind != TK_NUM)
-    error_tok(token, "数が必要です");
-  int val = token->val;
-  token = token->next;
-  return val;
+  Token *tok = &tokens[token_pos];
+  if (tok->kind != TK_NUM)
+    error_tok(tok, "数が必要です");
+  token_pos++;
+  return tok->val;
 }
 
 // 次のトークンが識別子の場合、トークンを1つ読み進めてその文字列を返す。
 // それ以外の場合にはエラーを報告する。
 char *expect_ident() {
-  if (token->kind != TK_IDENT)
-    error_tok(token, "識別子が必要です");
-  char *s = duplicate_string_n(token->str, token->len);
-  token = token->next;
-  return s;
+  Token *tok = &tokens[token_pos];
+  if (tok->kind != TK_IDENT)
+    error_tok(tok, "識別子が必要です");
+  token_pos++;
+  return duplicate_string_n(tok->str, tok->len);
 }
 
-bool at_eof() { return token->kind == TK_EOF; }
+bool at_eof() { return tokens[token_pos].kind == TK_EOF; }
 
 // 文字列pの長さlenの部分文字列をコピーして新しい文字列を作成して返す
 char *duplicate_string_n(char *p, int len) {
@@ -139,13 +196,18 @@ char *duplicate_string_n(char *p, int len) {
   return buf;
 }
 
-// 新しいトークンを作成してcurに繋げる
-Token *new_token(TokenKind kind, Token *cur, char *str, int len) {
-  Token *tok = calloc(1, sizeof(Token));
+// 新しいトークンをトークン列の末尾に追加する
+// 返したポインタは次にトークンを追加するまでしか使えない
+Token *new_token(TokenKind kind, char *str, int len) {
+  if (num_tokens == tokens_capacity) {
+    tokens_capacity = tokens_capacity ? tokens_capacity * 2 : 1024;
+    tokens = realloc(tokens, tokens_capacity * sizeof(Token));
+  }
+  Token *tok = &tokens[num_tokens++];
+  memset(tok, 0, sizeof(*tok));
   tok->kind = kind;
   tok->str = str;
   tok->len = len;
-  cur->next = tok;
   return tok;
 }
 
@@ -158,14 +220,15 @@ bool is_alpha(char c) {
 bool is_alnum(char c) { return is_alpha(c) || ('0' <= c && c <= '9'); }
 
 // 予約語をマッチングして新しいトークンを返す。マッチしなければNULLを返す
-Token *try_keyword(Token *cur, char **p) {
+Token *try_keyword(char **p) {
   static char *keywords[] = {
-      "return", "if", "else", "while", "for", "int", "char", "sizeof",
+      "return", "if",    "else", "while",   "for",   "int",
+      "char",   "sizeof", "switch", "case", "default", "break",
   };
   for (int i = 0; i < sizeof(keywords) / sizeof(*keywords); i++) {
     int len = strlen(keywords[i]);
     if (startswith(*p, keywords[i]) && !is_alnum((*p)[len])) {
-      Token *tok = new_token(TK_RESERVED, cur, *p, len);
+      Token *tok = new_token(TK_RESERVED, *p, len);
       *p += len;
       return tok;
     }
@@ -174,17 +237,25 @@ Token *try_keyword(Token *cur, char **p) {
 }
 
 // 2文字の演算子をマッチングして新しいトークンを返す。マッチしなければNULLを返す
-Token *try_multi_char_op(Token *cur, char **p) {
+Token *try_multi_char_op(char **p) {
   static char *multi_char_ops[] = {
       "==",
       "!=",
       "<=",
       ">=",
+      "&&",
+      "||",
+      "++",
+      "--",
+      "+=",
+      "-=",
+      "*=",
+      "/=",
   };
   for (int i = 0; i < sizeof(multi_char_ops) / sizeof(*multi_char_ops); i++) {
     int len = strlen(multi_char_ops[i]);
     if (startswith(*p, multi_char_ops[i])) {
-      Token *tok = new_token(TK_RESERVED, cur, *p, len);
+      Token *tok = new_token(TK_RESERVED, *p, len);
       *p += len;
       return tok;
     }
@@ -218,7 +289,7 @@ char get_escape_char(char c) {
   }
 }
 
-Token *read_string_literal(Token *cur, char *start) {
+Token *read_string_literal(char *start) {
   char *p = start + 1; // 開始の " をスキップ
   char buf[1024];
   int len = 0;
@@ -239,7 +310,7 @@ Token *read_string_literal(Token *cur, char *start) {
     }
   }
 
-  Token *tok = new_token(TK_STR, cur, start, p - start + 1);
+  Token *tok = new_token(TK_STR, start, p - start + 1);
   tok->contents = malloc(len + 1);
   memcpy(tok->contents, buf, len);
   tok->contents[len] = '\0';
@@ -247,12 +318,12 @@ Token *read_string_literal(Token *cur, char *start) {
   return tok;
 }
 
-// 入力文字列pをトークナイズしてそれを返す
-Token *tokenize() {
+// 入力文字列をトークナイズしてtokensに並べる
+void tokenize() {
   char *p = user_input;
-  Token head;
-  head.next = NULL;
-  Token *cur = &head;
+  tokens = NULL;
+  num_tokens = tokens_capacity = token_pos = 0;
+  num_lines = 0;
 
   while (*p) {
     // 空白文字をスキップ
@@ -279,22 +350,16 @@ Token *tokenize() {
     }
 
     // 予約語
-    Token *tok = try_keyword(cur, &p);
-    if (tok) {
-      cur = tok;
+    if (try_keyword(&p))
       continue;
-    }
 
     // 2文字の記号
-    tok = try_multi_char_op(cur, &p);
-    if (tok) {
-      cur = tok;
+    if (try_multi_char_op(&p))
       continue;
-    }
 
     // 1文字の記号
-    if (strchr("+-*/()<>;={},&[]", *p)) {
-      cur = new_token(TK_RESERVED, cur, p, 1);
+    if (strchr("+-*/()<>;={},&[]:!?", *p)) {
+      new_token(TK_RESERVED, p, 1);
       p++;
       continue;
     }
@@ -306,14 +371,13 @@ Token *tokenize() {
       while (is_alnum(*p)) {
         p++;
       }
-      cur = new_token(TK_IDENT, cur, start, p - start);
+      new_token(TK_IDENT, start, p - start);
       continue;
     }
 
     // 文字列リテラル
     if (*p == '"') {
-      cur = read_string_literal(cur, p);
-      p += cur->len;
+      p += read_string_literal(p)->len;
       continue;
     }
 
@@ -322,14 +386,12 @@ Token *tokenize() {
       char *num_start = p;
       long val = strtol(p, &p, 10);
       int len = (int)(p - num_start);
-      cur = new_token(TK_NUM, cur, num_start, len);
-      cur->val = val;
+      new_token(TK_NUM, num_start, len)->val = val;
       continue;
     }
 
     error_at(p, "トークナイズできません");
   }
 
-  new_token(TK_EOF, cur, p, 0);
-  return head.next;
+  new_token(TK_EOF, p, 0);
 }
@@ -1,31 +1,43 @@
 #include "he3cc.h"
 
-// 新しいTypeを生成する関数
-Type *new_type(TypeKind kind) {
+// 基本型 (プログラム全体で1つずつ)
+Type char_type_obj = {TY_CHAR};
+Type int_type_obj = {TY_INT};
+
+// ポインタ型・配列型の表。種類・指す型・要素数が同じ型は1つだけ作る。
+// 翻訳単位はスレッドごとに処理するので、表もスレッドごとに持つ
+#define TYPE_BUCKETS 256
+_Thread_local Type *derived_types[TYPE_BUCKETS];
+
+// 種類kind、指す型base、要素数sizeの派生型を表から探し、なければ作る
+Type *intern_type(TypeKind kind, Type *base, int size) {
+  unsigned long h = (unsigned long)base / sizeof(Type) * 31 + size * 2 + kind;
+  Type **bucket = &derived_types[h % TYPE_BUCKETS];
+  for (Type *ty = *bucket; ty; ty = ty->next)
+    if (ty->kind == kind && ty->base == base && ty->array_size == size)
+      return ty;
+
   Type *ty = calloc(1, sizeof(Type));
   ty->kind = kind;
+  ty->base = base;
+  ty->array_size = size;
+  ty->next = *bucket;
+  *bucket = ty;
   return ty;
 }
 
-// 文字型を表すTypeを生成
-Type *char_type() { return new_type(TY_CHAR); }
+// 文字型を表すTypeを返す
+Type *char_type() { return &char_type_obj; }
 
-// 整数型を表すTypeを生成
-Type *int_type() { return new_type(TY_INT); }
+// 整数型を表すTypeを返す
+Type *int_type() { return &int_type_obj; }
 
-// ポインタ型を表すTypeを生成
-Type *pointer_to(Type *base) {
-  Type *ty = new_type(TY_PTR);
-  ty->base = base;
-  return ty;
-}
+// ポインタ型を表すTypeを返す
+Type *pointer_to(Type *base) { return intern_type(TY_PTR, base, 0); }
 
-// 配列型を表すTypeを生成
+// 配列型を表すTypeを返す
 Type *array_of(Type *base, int size) {
-  Type *ty = new_type(TY_ARRAY);
-  ty->base = base;
-  ty->array_size = size;
-  return ty;
+  return intern_type(TY_ARRAY, base, size);
 }
 
 // 型のサイズを返す関数
@@ -43,24 +55,9 @@ int size_of(Type *ty) {
   }
 }
 
-void visit(Node *node) {
-  if (!node)
-    return;
-
-  // 子ノードを再帰的に訪問
-  visit(node->lhs);
-  visit(node->rhs);
-  visit(node->cond);
-  visit(node->then);
-  visit(node->els);
-  visit(node->init);
-  visit(node->inc);
-
-  for (Node *n = node->body; n; n = n->next)
-    visit(n);
-  for (Node *n = node->args; n; n = n->next)
-    visit(n);
-
+// ノードの型を決める。子ノードの型はすでに決まっているものとする。
+// パーサーがノードを組み立てるたびに呼ぶので、型は下から順に決まる
+void add_type(Node *node) {
   // ノードの種類に応じて型情報を付与
   switch (node->kind) {
   // int型のみ
@@ -70,6 +67,11 @@ void visit(Node *node) {
   case ND_NE:
   case ND_LT:
   case ND_LE:
+  case ND_GT:
+  case ND_GE:
+  case ND_LOGAND:
+  case ND_LOGOR:
+  case ND_NOT:
   case ND_FUN_CALL:
   case ND_NUM:
     node->ty = int_type();
@@ -103,11 +105,38 @@ void visit(Node *node) {
     node->ty = node->lhs->ty;
     return;
 
+  // 条件演算子: then節がポインタならその型、そうでなければelse節の型
+  // (どちらかがポインタならその型になる)。
+  // 配列は先頭要素へのポインタとして扱う
+  case ND_COND: {
+    Type *ty = node->then->ty->base ? node->then->ty : node->els->ty;
+    if (ty->kind == TY_ARRAY)
+      ty = pointer_to(ty->base);
+    node->ty = ty;
+    return;
+  }
+
   // 代入: 左辺の型を継承
   case ND_ASSIGN:
     node->ty = node->lhs->ty;
     return;
 
+  // 複合代入・後置++/--: 左辺の型を継承。ポインタは加減算のみ
+  case ND_ADD_ASSIGN:
+  case ND_SUB_ASSIGN:
+  case ND_POST_INC:
+  case ND_POST_DEC:
+    if (node->rhs->ty->base)
+      error_tok(node->tok, "ポインタを加減算の右辺にはできません");
+    node->ty = node->lhs->ty;
+    return;
+  case ND_MUL_ASSIGN:
+  case ND_DIV_ASSIGN:
+    if (node->lhs->ty->base || node->rhs->ty->base)
+      error_tok(node->tok, "ポインタの乗除算はできません");
+    node->ty = node->lhs->ty;
+    return;
+
   // アドレス取得: T -> T*
   case ND_ADDR:
     if (node->lhs->ty->kind == TY_ARRAY) {
@@ -126,14 +155,6 @@ void visit(Node *node) {
     node->ty = node->lhs->ty->base;
     return;
 
-  // sizeof演算子: コンパイル時に型のサイズを計算して整数ノードに変換
-  case ND_SIZEOF:
-    node->kind = ND_NUM;
-    node->ty = int_type();
-    node->val = size_of(node->lhs->ty);
-    node->lhs = NULL; // 子ノードは不要になる
-    return;
-
   // GNU拡張の式文: 最後の文の型を継承
   case ND_STMT_EXPR: {
     Node *last = node->body;
@@ -148,8 +169,3 @@ void visit(Node *node) {
   }
 }
 
-void add_type(Program *prog) {
-  for (Function *fn = prog->fns; fn; fn = fn->next)
-    for (Node *node = fn->node; node; node = node->next)
-      visit(node);
-}
@@ -0,0 +1,745 @@
+#include "he3cc.h"
+
+// バイトコードVM (--vm)
+//
+// 構文木をスタックマシンのバイトコードに変換して、その場で実行する。
+// アセンブラやリンカ、ARM64の実行環境がなくても、どのLinuxでもすぐに
+// テストを動かせる。ネイティブのコード生成と比べる基準にもなる。
+//
+// 値はすべて8バイトの整数で、ポインタはホストの実アドレスをそのまま使う。
+// そのため文字列などはprintfにそのまま渡せる。命令の列は実行前に
+// 各命令の処理へのアドレスに置き換え、computed gotoで次の命令に飛ぶ。
+
+// 命令の種類
+typedef enum {
+  OP_PUSH,        // PUSH val: 定数を積む
+  OP_LADDR,       // LADDR off: ローカル変数のアドレスを積む
+  OP_GADDR,       // GADDR addr: グローバル変数のアドレスを積む
+  OP_LOAD_LOCAL,  // LOAD_LOCAL off: ローカル変数の8バイトの値を積む
+  OP_LOAD,        // アドレスを取り出して8バイトの値を積む
+  OP_LOAD1,       // アドレスを取り出して1バイトの値を符号拡張して積む
+  OP_STORE,       // 値とアドレスを取り出して8バイト書き込み、値を積む
+  OP_STORE1,      // 値とアドレスを取り出して1バイト書き込み、値を積む
+  OP_DUP,         // 先頭の値を複製する
+  OP_POP,         // 先頭の値を捨てる
+  OP_ADD,         // +
+  OP_SUB,         // -
+  OP_MUL,         // *
+  OP_DIV,         // /
+  OP_EQ,          // ==
+  OP_NE,          // !=
+  OP_LT,          // <
+  OP_LE,          // <=
+  OP_GT,          // >
+  OP_GE,          // >=
+  OP_NOT,         // !
+  OP_JMP,         // JMP target: 無条件に分岐する
+  OP_JZ,          // JZ target: 値を取り出し、0なら分岐する
+  OP_JNZ,         // JNZ target: 値を取り出し、0でなければ分岐する
+  OP_CASE,        // CASE val target: 先頭の値がvalなら取り出して分岐する
+  OP_CALL,        // CALL func nargs: 関数を呼び出す
+  OP_CALL_NATIVE, // CALL_NATIVE native nargs: libcの関数を呼び出す
+  OP_RET,         // 値を取り出して呼び出し元に戻り、値を積む
+  OP_HALT,        // 実行を終える
+  NUM_OPS,
+} OpCode;
+
+// 命令ごとのオペランドの数
+int vm_op_nargs[NUM_OPS] = {
+    [OP_PUSH] = 1, [OP_LADDR] = 1, [OP_GADDR] = 1, [OP_LOAD_LOCAL] = 1,
+    [OP_JMP] = 1,  [OP_JZ] = 1,    [OP_JNZ] = 1,   [OP_CASE] = 2,
+    [OP_CALL] = 2, [OP_CALL_NATIVE] = 2,
+};
+
+// 呼び出される関数
+typedef struct VmFunc VmFunc;
+struct VmFunc {
+  VmFunc *next;
+  char *name;
+  Function *fn;   // 定義 (libcの関数ならNULL)
+  int entry;      // 先頭の命令の位置
+  int frame_size; // ローカル変数の領域のバイト数
+
+  // 仮引数を書き込む位置
+  int nparams;
+  int *param_offsets;
+  bool *param_is_char;
+};
+
+// libcの関数の呼び出し
+typedef struct {
+  char *name;
+  long (*fn)(long *args, int nargs);
+} NativeFunc;
+
+// libcの関数に渡せる引数の数 (これより多い呼び出しは変換時にエラーにする)
+#define NATIVE_MAX_ARGS 16
+
+long vm_native_printf(long *args, int nargs) {
+  long a[NATIVE_MAX_ARGS] = {0};
+  for (int i = 0; i < nargs; i++)
+    a[i] = args[i];
+  return printf((char *)a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8],
+                a[9], a[10], a[11], a[12], a[13], a[14], a[15]);
+}
+
+long vm_native_exit(long *args, int nargs) {
+  exit(nargs ? args[0] : 0);
+}
+
+NativeFunc vm_natives[] = {
+    {"printf", vm_native_printf},
+    {"exit", vm_native_exit},
+};
+
+// 変換中の命令列
+long *vm_code;
+int vm_code_len;
+int vm_code_cap;
+
+// ラベルの位置と、ラベルを参照しているオペランドの位置
+int *vm_label_pos;
+int vm_num_labels;
+int *vm_patches;
+int vm_num_patches;
+
+VmFunc *vm_funcs;
+
+// breakで抜ける先のラベル (ループやswitch文の外では-1)
+int vm_brk_label = -1;
+
+// グローバル変数の領域
+char *vm_data;
+
+void vm_emit_word(long val) {
+  if (vm_code_len == vm_code_cap) {
+    vm_code_cap = vm_code_cap ? vm_code_cap * 2 : 1024;
+    vm_code = realloc(vm_code, vm_code_cap * sizeof(long));
+  }
+  vm_code[vm_code_len++] = val;
+}
+
+void vm_emit_op(OpCode op) { vm_emit_word(op); }
+
+void vm_emit_op1(OpCode op, long val) {
+  vm_emit_word(op);
+  vm_emit_word(val);
+}
+
+int vm_new_label(void) {
+  vm_label_pos = realloc(vm_label_pos, (vm_num_labels + 1) * sizeof(int));
+  vm_label_pos[vm_num_labels] = -1;
+  return vm_num_labels++;
+}
+
+void vm_bind_label(int label) { vm_label_pos[label] = vm_code_len; }
+
+// ラベルを参照するオペランドを出力する。位置は最後に埋める
+void vm_emit_label_ref(int label) {
+  vm_patches = realloc(vm_patches, (vm_num_patches + 1) * sizeof(int));
+  vm_patches[vm_num_patches++] = vm_code_len;
+  vm_emit_word(label);
+}
+
+void vm_emit_jump(OpCode op, int label) {
+  vm_emit_op(op);
+  vm_emit_label_ref(label);
+}
+
+VmFunc *vm_find_func(char *name) {
+  for (VmFunc *f = vm_funcs; f; f = f->next)
+    if (!strcmp(f->name, name))
+      return f;
+  VmFunc *f = calloc(1, sizeof(VmFunc));
+  f->name = name;
+  f->next = vm_funcs;
+  vm_funcs = f;
+  return f;
+}
+
+void vm_gen_expr(Node *node);
+void vm_gen_stmt(Node *node);
+
+// 左辺値nodeのアドレスを積む
+void vm_gen_addr(Node *node) {
+  switch (node->kind) {
+  case ND_VAR:
+    if (node->var->is_local)
+      vm_emit_op1(OP_LADDR, node->var->offset);
+    else
+      vm_emit_op1(OP_GADDR, (long)(vm_data + node->var->offset));
+    return;
+  case ND_DEREF:
+    vm_gen_expr(node->lhs);
+    return;
+  default:
+    error_tok(node->tok, "代入の左辺値が変数ではありません");
+  }
+}
+
+void vm_check_lval(Node *node) {
+  if (node->ty->kind == TY_ARRAY)
+    error_tok(node->tok, "配列は代入の左辺値になれません");
+}
+
+// 先頭のアドレスから型tyの値を読む。配列はアドレスのまま使う
+void vm_gen_load(Type *ty) {
+  if (ty->kind == TY_ARRAY)
+    return;
+  vm_emit_op(size_of(ty) == 1 ? OP_LOAD1 : OP_LOAD);
+}
+
+void vm_gen_store(Type *ty) {
+  vm_emit_op(size_of(ty) == 1 ? OP_STORE1 : OP_STORE);
+}
+
+// 型tyの値に対する加減算なら、右辺をポインタの要素サイズ倍する
+void vm_gen_scale(NodeKind op, Type *ty) {
+  if ((op == ND_ADD || op == ND_SUB) && ty->base) {
+    vm_emit_op1(OP_PUSH, size_of(ty->base));
+    vm_emit_op(OP_MUL);
+  }
+}
+
+OpCode vm_arith_op(NodeKind kind) {
+  switch (kind) {
+  case ND_ADD:
+  case ND_ADD_ASSIGN:
+  case ND_POST_INC:
+    return OP_ADD;
+  case ND_SUB:
+  case ND_SUB_ASSIGN:
+  case ND_POST_DEC:
+    return OP_SUB;
+  case ND_MUL:
+  case ND_MUL_ASSIGN:
+    return OP_MUL;
+  case ND_DIV:
+  case ND_DIV_ASSIGN:
+    return OP_DIV;
+  case ND_EQ:
+    return OP_EQ;
+  case ND_NE:
+    return OP_NE;
+  case ND_LT:
+    return OP_LT;
+  case ND_LE:
+    return OP_LE;
+  case ND_GT:
+    return OP_GT;
+  case ND_GE:
+    return OP_GE;
+  default:
+    error("不正な演算です");
+    return OP_HALT;
+  }
+}
+
+// 複合代入と後置インクリメント/デクリメント。左辺のアドレスは一度だけ
+// 計算する。後置なら、更新した値から増分を戻して更新前の値を残す
+void vm_gen_assign_op(Node *node) {
+  vm_check_lval(node->lhs);
+  OpCode op = vm_arith_op(node->kind);
+  NodeKind kind = op == OP_ADD ? ND_ADD : op == OP_SUB ? ND_SUB : ND_MUL;
+
+  vm_gen_addr(node->lhs);
+  vm_emit_op(OP_DUP);
+  vm_gen_load(node->lhs->ty);
+  vm_gen_expr(node->rhs);
+  vm_gen_scale(kind, node->lhs->ty);
+  vm_emit_op(op);
+  vm_gen_store(node->lhs->ty);
+
+  if (node->kind == ND_POST_INC || node->kind == ND_POST_DEC) {
+    vm_gen_expr(node->rhs);
+    vm_gen_scale(kind, node->lhs->ty);
+    vm_emit_op(op == OP_ADD ? OP_SUB : OP_ADD);
+  }
+}
+
+void vm_gen_expr(Node *node) {
+  switch (node->kind) {
+  case ND_NUM:
+    vm_emit_op1(OP_PUSH, node->val);
+    return;
+  case ND_VAR:
+    if (node->var->is_local && node->ty->kind != TY_ARRAY &&
+        size_of(node->ty) != 1) {
+      vm_emit_op1(OP_LOAD_LOCAL, node->var->offset);
+      return;
+    }
+    vm_gen_addr(node);
+    vm_gen_load(node->ty);
+    return;
+  case ND_DEREF:
+    vm_gen_addr(node);
+    vm_gen_load(node->ty);
+    return;
+  case ND_ADDR:
+    vm_gen_addr(node->lhs);
+    return;
+  case ND_ASSIGN:
+    vm_check_lval(node->lhs);
+    vm_gen_addr(node->lhs);
+    vm_gen_expr(node->rhs);
+    vm_gen_store(node->lhs->ty);
+    return;
+  case ND_ADD_ASSIGN:
+  case ND_SUB_ASSIGN:
+  case ND_MUL_ASSIGN:
+  case ND_DIV_ASSIGN:
+  case ND_POST_INC:
+  case ND_POST_DEC:
+    vm_gen_assign_op(node);
+    return;
+  case ND_FUN_CALL: {
+    int nargs = 0;
+    for (Node *arg = node->args; arg; arg = arg->next) {
+      vm_gen_expr(arg);
+      nargs++;
+    }
+    vm_emit_op(OP_CALL);
+    vm_emit_word((long)vm_find_func(node->func_name));
+    vm_emit_word(nargs);
+    return;
+  }
+  case ND_STMT_EXPR: {
+    // 最後の文は式そのものになっていて、その値が全体の値になる
+    Node *n = node->body;
+    for (; n->next; n = n->next)
+      vm_gen_stmt(n);
+    vm_gen_expr(n);
+    return;
+  }
+  case ND_NOT:
+    vm_gen_expr(node->lhs);
+    vm_emit_op(OP_NOT);
+    return;
+  case ND_LOGAND:
+  case ND_LOGOR: {
+    // &&は左辺が0なら0、||は左辺が0でなければ1になる
+    bool is_and = node->kind == ND_LOGAND;
+    int skip = vm_new_label();
+    int end = vm_new_label();
+    vm_gen_expr(node->lhs);
+    vm_emit_jump(is_and ? OP_JZ : OP_JNZ, skip);
+    vm_gen_expr(node->rhs);
+    vm_emit_jump(is_and ? OP_JZ : OP_JNZ, skip);
+    vm_emit_op1(OP_PUSH, is_and);
+    vm_emit_jump(OP_JMP, end);
+    vm_bind_label(skip);
+    vm_emit_op1(OP_PUSH, !is_and);
+    vm_bind_label(end);
+    return;
+  }
+  case ND_COND: {
+    int els = vm_new_label();
+    int end = vm_new_label();
+    vm_gen_expr(node->cond);
+    vm_emit_jump(OP_JZ, els);
+    vm_gen_expr(node->then);
+    vm_emit_jump(OP_JMP, end);
+    vm_bind_label(els);
+    vm_gen_expr(node->els);
+    vm_bind_label(end);
+    return;
+  }
+  default:
+    break;
+  }
+
+  vm_gen_expr(node->lhs);
+  vm_gen_expr(node->rhs);
+  vm_gen_scale(node->kind, node->ty);
+  vm_emit_op(vm_arith_op(node->kind));
+}
+
+void vm_gen_switch(Node *node) {
+  int brk = vm_new_label();
+  vm_gen_expr(node->cond);
+
+  // 一致するcaseを順に探す。どれにも一致しなければ値を捨てて
+  // default節、なければswitch文の後ろに飛ぶ
+  for (Node *n = node->case_next; n; n = n->case_next) {
+    for (Node *m = node->case_next; m != n; m = m->case_next)
+      if (m->val == n->val)
+        error_tok(n->tok, "caseの値が重複しています");
+    n->case_label = vm_new_label();
+    vm_emit_op1(OP_CASE, n->val);
+    vm_emit_label_ref(n->case_label);
+  }
+  vm_emit_op(OP_POP);
+  if (node->default_case) {
+    node->default_case->case_label = vm_new_label();
+    vm_emit_jump(OP_JMP, node->default_case->case_label);
+  } else {
+    vm_emit_jump(OP_JMP, brk);
+  }
+
+  int prev = vm_brk_label;
+  vm_brk_label = brk;
+  vm_gen_stmt(node->then);
+  vm_brk_label = prev;
+  vm_bind_label(brk);
+}
+
+void vm_gen_stmt(Node *node) {
+  switch (node->kind) {
+  case ND_NULL:
+    return;
+  case ND_EXPR_STMT:
+    vm_gen_expr(node->lhs);
+    vm_emit_op(OP_POP);
+    return;
+  case ND_RETURN:
+    vm_gen_expr(node->lhs);
+    vm_emit_op(OP_RET);
+    return;
+  case ND_BLOCK:
+    for (Node *n = node->body; n; n = n->next)
+      vm_gen_stmt(n);
+    return;
+  case ND_IF: {
+    int els = vm_new_label();
+    int end = vm_new_label();
+    vm_gen_expr(node->cond);
+    vm_emit_jump(OP_JZ, els);
+    vm_gen_stmt(node->then);
+    vm_emit_jump(OP_JMP, end);
+    vm_bind_label(els);
+    if (node->els)
+      vm_gen_stmt(node->els);
+    vm_bind_label(end);
+    return;
+  }
+  case ND_WHILE:
+  case ND_FOR: {
+    int begin = vm_new_label();
+    int brk = vm_new_label();
+    bool is_for = node->kind == ND_FOR;
+    if (is_for && node->init)
+      vm_gen_stmt(node->init);
+    vm_bind_label(begin);
+    if (node->cond) {
+      vm_gen_expr(node->cond);
+      vm_emit_jump(OP_JZ, brk);
+    }
+
+    int prev = vm_brk_label;
+    vm_brk_label = brk;
+    vm_gen_stmt(node->then);
+    vm_brk_label = prev;
+
+    if (is_for && node->inc)
+      vm_gen_stmt(node->inc);
+    vm_emit_jump(OP_JMP, begin);
+    vm_bind_label(brk);
+    return;
+  }
+  case ND_SWITCH:
+    vm_gen_switch(node);
+    return;
+  case ND_CASE:
+    vm_bind_label(node->case_label);
+    vm_gen_stmt(node->lhs);
+    return;
+  case ND_BREAK:
+    if (vm_brk_label < 0)
+      error_tok(node->tok, "ループやswitch文の外でbreakが使われています");
+    vm_emit_jump(OP_JMP, vm_brk_label);
+    return;
+  default:
+    vm_gen_expr(node);
+    vm_emit_op(OP_POP);
+    return;
+  }
+}
+
+// グローバル変数の領域を確保して、文字列リテラルの内容を置く
+void vm_alloc_data(Program *prog) {
+  int offset = 0;
+  for (VarList *vl = prog->global_vars; vl; vl = vl->next) {
+    Var *var = vl->var;
+    offset = align_to(offset, 8);
+    var->offset = offset;
+    offset += var->contents ? var->contents_len : size_of(var->ty);
+  }
+
+  vm_data = calloc(1, offset + 1);
+  for (VarList *vl = prog->global_vars; vl; vl = vl->next)
+    if (vl->var->contents)
+      memcpy(vm_data + vl->var->offset, vl->var->contents,
+             vl->var->contents_len);
+}
+
+void vm_gen_function(Function *fn) {
+  // ネイティブのコード生成と同じく、ローカル変数のリストの先頭から順に
+  // フレームの終わりから並べる
+  int offset = 0;
+  for (VarList *vl = fn->local_vars; vl; vl = vl->next)
+    offset += size_of(vl->var->ty);
+  int end = offset;
+  for (VarList *vl = fn->local_vars; vl; vl = vl->next) {
+    offset -= size_of(vl->var->ty);
+    vl->var->offset = offset;
+  }
+
+  VmFunc *f = vm_find_func(fn->name);
+  if (f->fn)
+    error("関数が重複しています: %s", fn->name);
+  f->fn = fn;
+  f->entry = vm_code_len;
+  f->frame_size = align_to(end, 16);
+
+  for (VarList *vl = fn->params; vl; vl = vl->next)
+    f->nparams++;
+  f->param_offsets = calloc(f->nparams, sizeof(int));
+  f->param_is_char = calloc(f->nparams, sizeof(bool));
+  int i = 0;
+  for (VarList *vl = fn->params; vl; vl = vl->next, i++) {
+    f->param_offsets[i] = vl->var->offset;
+    f->param_is_char[i] = size_of(vl->var->ty) == 1;
+  }
+
+  for (Node *n = fn->node; n; n = n->next)
+    vm_gen_stmt(n);
+
+  // 末尾まで実行したら0を返す
+  vm_emit_op1(OP_PUSH, 0);
+  vm_emit_op(OP_RET);
+}
+
+// 呼び出す関数を解決する。定義がなければlibcの関数を探す
+void vm_resolve_calls(void) {
+  for (int pc = 0; pc < vm_code_len; pc += vm_op_nargs[vm_code[pc]] + 1) {
+    if (vm_code[pc] != OP_CALL)
+      continue;
+    VmFunc *f = (VmFunc *)vm_code[pc + 1];
+    if (f->fn)
+      continue;
+
+    int i = 0;
+    int n = sizeof(vm_natives) / sizeof(*vm_natives);
+    while (i < n && strcmp(vm_natives[i].name, f->name))
+      i++;
+    if (i == n)
+      error("未定義の関数です: %s", f->name);
+    if (vm_code[pc + 2] > NATIVE_MAX_ARGS)
+      error("--vmでは%sに渡せる引数は%d個までです", f->name, NATIVE_MAX_ARGS);
+    vm_code[pc] = OP_CALL_NATIVE;
+    vm_code[pc + 1] = i;
+  }
+}
+
+// 実行時のスタックの大きさ
+#define VALUE_STACK_SIZE (1 << 20)
+#define CALL_STACK_SIZE (1 << 14)
+#define FRAME_STACK_SIZE (8 << 20)
+
+// 呼び出し元に戻るための情報
+typedef struct {
+  long *pc;   // 戻り先の命令
+  long *sp;   // 引数を取り除いた後の値のスタック
+  char *fp;   // 呼び出し元のフレームの先頭
+  char *fend; // 呼び出し元のフレームの終わり
+} CallFrame;
+
+// プログラムをバイトコードに変換して実行し、mainの戻り値を返す
+int vm_run(Program *prog) {
+  vm_alloc_data(prog);
+
+  // 先頭でmainを呼び出し、戻ったら終了する
+  vm_emit_op(OP_CALL);
+  vm_emit_word((long)vm_find_func("main"));
+  vm_emit_word(0);
+  vm_emit_op(OP_HALT);
+
+  for (Function *fn = prog->fns; fn; fn = fn->next)
+    vm_gen_function(fn);
+
+  for (int i = 0; i < vm_num_patches; i++)
+    vm_code[vm_patches[i]] = vm_label_pos[vm_code[vm_patches[i]]];
+  vm_resolve_calls();
+
+  // 命令を処理のアドレスに、分岐先を命令のアドレスに置き換える
+  static void *dispatch[NUM_OPS] = {
+      [OP_PUSH] = &&op_push,
+      [OP_LADDR] = &&op_laddr,
+      [OP_GADDR] = &&op_gaddr,
+      [OP_LOAD_LOCAL] = &&op_load_local,
+      [OP_LOAD] = &&op_load,
+      [OP_LOAD1] = &&op_load1,
+      [OP_STORE] = &&op_store,
+      [OP_STORE1] = &&op_store1,
+      [OP_DUP] = &&op_dup,
+      [OP_POP] = &&op_pop,
+      [OP_ADD] = &&op_add,
+      [OP_SUB] = &&op_sub,
+      [OP_MUL] = &&op_mul,
+      [OP_DIV] = &&op_div,
+      [OP_EQ] = &&op_eq,
+      [OP_NE] = &&op_ne,
+      [OP_LT] = &&op_lt,
+      [OP_LE] = &&op_le,
+      [OP_GT] = &&op_gt,
+      [OP_GE] = &&op_ge,
+      [OP_NOT] = &&op_not,
+      [OP_JMP] = &&op_jmp,
+      [OP_JZ] = &&op_jz,
+      [OP_JNZ] = &&op_jnz,
+      [OP_CASE] = &&op_case,
+      [OP_CALL] = &&op_call,
+      [OP_CALL_NATIVE] = &&op_call_native,
+      [OP_RET] = &&op_ret,
+      [OP_HALT] = &&op_halt,
+  };
+  for (int pc = 0; pc < vm_code_len;) {
+    OpCode op = vm_code[pc];
+    vm_code[pc] = (long)dispatch[op];
+    if (op == OP_JMP || op == OP_JZ || op == OP_JNZ)
+      vm_code[pc + 1] = (long)(vm_code + vm_code[pc + 1]);
+    else if (op == OP_CASE)
+      vm_code[pc + 2] = (long)(vm_code + vm_code[pc + 2]);
+    pc += vm_op_nargs[op] + 1;
+  }
+
+  long *stack = calloc(VALUE_STACK_SIZE, sizeof(long));
+  CallFrame *calls = calloc(CALL_STACK_SIZE, sizeof(CallFrame));
+  char *frames = calloc(1, FRAME_STACK_SIZE);
+
+  long *sp = stack; // 次に積む位置
+  CallFrame *csp = calls;
+  char *fp = frames;
+  char *fend = frames;
+  long *pc = vm_code;
+
+#define NEXT goto *(void *)*pc++
+#define BINARY(expr)                                                           \
+  do {                                                                         \
+    long b = *--sp;                                                            \
+    long a = sp[-1];                                                           \
+    sp[-1] = (expr);                                                           \
+    NEXT;                                                                      \
+  } while (0)
+
+  NEXT;
+
+op_push:
+  *sp++ = *pc++;
+  NEXT;
+op_laddr:
+  *sp++ = (long)(fp + *pc++);
+  NEXT;
+op_gaddr:
+  *sp++ = *pc++;
+  NEXT;
+op_load_local:
+  *sp++ = *(long *)(fp + *pc++);
+  NEXT;
+op_load:
+  sp[-1] = *(long *)sp[-1];
+  NEXT;
+op_load1:
+  sp[-1] = *(signed char *)sp[-1];
+  NEXT;
+op_store:
+  sp--;
+  *(long *)sp[-1] = *sp;
+  sp[-1] = *sp;
+  NEXT;
+op_store1:
+  sp--;
+  *(char *)sp[-1] = *sp;
+  sp[-1] = *sp;
+  NEXT;
+op_dup:
+  *sp = sp[-1];
+  sp++;
+  NEXT;
+op_pop:
+  sp--;
+  NEXT;
+op_add:
+  BINARY(a + b);
+op_sub:
+  BINARY(a - b);
+op_mul:
+  BINARY(a * b);
+op_div:
+  BINARY(a / b);
+op_eq:
+  BINARY(a == b);
+op_ne:
+  BINARY(a != b);
+op_lt:
+  BINARY(a < b);
+op_le:
+  BINARY(a <= b);
+op_gt:
+  BINARY(a > b);
+op_ge:
+  BINARY(a >= b);
+op_not:
+  sp[-1] = !sp[-1];
+  NEXT;
+op_jmp:
+  pc = (long *)*pc;
+  NEXT;
+op_jz:
+  pc = *--sp ? pc + 1 : (long *)*pc;
+  NEXT;
+op_jnz:
+  pc = *--sp ? (long *)*pc : pc + 1;
+  NEXT;
+op_case:
+  if (sp[-1] == pc[0]) {
+    sp--;
+    pc = (long *)pc[1];
+  } else {
+    pc += 2;
+  }
+  NEXT;
+op_call: {
+  VmFunc *f = (VmFunc *)pc[0];
+  int nargs = pc[1];
+  if (csp == calls + CALL_STACK_SIZE ||
+      sp + 1024 > stack + VALUE_STACK_SIZE ||
+      fend + f->frame_size > frames + FRAME_STACK_SIZE)
+    error("%s: 呼び出しが深すぎます", f->name);
+
+  // 呼び出し元のフレームの後ろに新しいフレームを置き、引数を仮引数に書く
+  sp -= nargs;
+  *csp++ = (CallFrame){pc + 2, sp, fp, fend};
+  fp = fend;
+  fend = fp + f->frame_size;
+  for (int i = 0; i < nargs && i < f->nparams; i++) {
+    if (f->param_is_char[i])
+      *(char *)(fp + f->param_offsets[i]) = sp[i];
+    else
+      *(long *)(fp + f->param_offsets[i]) = sp[i];
+  }
+  pc = vm_code + f->entry;
+  NEXT;
+}
+op_call_native: {
+  NativeFunc *nf = &vm_natives[pc[0]];
+  int nargs = pc[1];
+  pc += 2;
+  sp -= nargs;
+  *sp = nf->fn(sp, nargs);
+  sp++;
+  NEXT;
+}
+op_ret: {
+  long val = sp[-1];
+  csp--;
+  pc = csp->pc;
+  sp = csp->sp;
+  fp = csp->fp;
+  fend = csp->fend;
+  *sp++ = val;
+  NEXT;
+}
+op_halt:
+  return sp[-1];
+}